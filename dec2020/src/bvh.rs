@@ -0,0 +1,174 @@
+use na::Vector3;
+use std::cmp::Ordering;
+use crate::{Ray, Triangle, triangle_intersect_mt};
+
+// Triangles per leaf, and a traversal stack deep enough for any median split
+const LEAF: usize = 4;
+const STACK: usize = 64;
+
+#[derive(Clone, Copy)]
+struct Aabb {
+    lo: Vector3<f32>,
+    hi: Vector3<f32>
+}
+
+impl Aabb {
+    fn empty() -> Self {
+        Aabb {
+            lo: Vector3::new(std::f32::MAX, std::f32::MAX, std::f32::MAX),
+            hi: Vector3::new(-std::f32::MAX, -std::f32::MAX, -std::f32::MAX)
+        }
+    }
+
+    // Padded a little so rounding in the box test never loses an edge hit
+    fn of(tri: &Triangle) -> Self {
+        let mut b = Aabb::empty();
+        for p in [tri.o0, tri.o1, tri.o2].iter() {
+            b.grow(p);
+        }
+        let pad = 1e-4 * (b.hi - b.lo).amax() + 1e-6;
+        b.lo -= Vector3::new(pad, pad, pad);
+        b.hi += Vector3::new(pad, pad, pad);
+        b
+    }
+
+    fn grow(&mut self, p: &Vector3<f32>) {
+        self.lo = self.lo.inf(p);
+        self.hi = self.hi.sup(p);
+    }
+
+    fn join(&mut self, b: &Aabb) {
+        self.lo = self.lo.inf(&b.lo);
+        self.hi = self.hi.sup(&b.hi);
+    }
+
+    fn center(&self) -> Vector3<f32> {
+        (self.lo + self.hi) * 0.5
+    }
+
+    // Slab test limited to [0, t_max]
+    fn hit(&self, r: &Ray, inv: &Vector3<f32>, t_max: f32) -> bool {
+        let t0 = (self.lo - r.o).component_mul(inv);
+        let t1 = (self.hi - r.o).component_mul(inv);
+        let near = t0.x.min(t1.x).max(t0.y.min(t1.y)).max(t0.z.min(t1.z)).max(0.0);
+        let far = t0.x.max(t1.x).min(t0.y.max(t1.y)).min(t0.z.max(t1.z)).min(t_max);
+
+        near <= far
+    }
+}
+
+// Nodes are stored depth first: an inner node's left child follows it and
+// `first` is its right child, a leaf holds `count` triangles from `first`.
+struct Node {
+    bounds: Aabb,
+    first: u32,
+    count: u16,
+    axis: u16
+}
+
+pub struct Bvh {
+    nodes: Vec<Node>,
+    pub tris: Vec<Triangle>
+}
+
+impl Bvh {
+    // Splits at the median centroid along the widest axis, then stores the
+    // triangles in leaf order
+    pub fn new(tris: Vec<Triangle>) -> Self {
+        let boxes: Vec<Aabb> = tris.iter().map(Aabb::of).collect();
+        let mut order: Vec<usize> = (0..tris.len()).collect();
+        let mut nodes = Vec::with_capacity(2 * tris.len() / LEAF + 1);
+
+        if !tris.is_empty() {
+            split(&mut nodes, &boxes, &mut order, 0);
+        }
+
+        let mut slots: Vec<Option<Triangle>> = tris.into_iter().map(Some).collect();
+        let tris = order.iter().map(|&i| slots[i].take().unwrap()).collect();
+
+        Bvh { nodes: nodes, tris: tris }
+    }
+
+    pub fn nodes(&self) -> usize {
+        self.nodes.len()
+    }
+
+    // Closest triangle in front of the ray as (t, index into tris)
+    pub fn hit(&self, r: &Ray) -> Option<(f32, usize)> {
+        if self.nodes.is_empty() {
+            return None;
+        }
+
+        let inv = Vector3::new(1.0 / r.d.x, 1.0 / r.d.y, 1.0 / r.d.z);
+        let neg = [r.d.x < 0.0, r.d.y < 0.0, r.d.z < 0.0];
+        let mut stack = [0usize; STACK];
+        let mut sp = 0;
+        let mut node = 0;
+        let mut smallest = std::f32::MAX;
+        let mut index = None;
+
+        loop {
+            let n = &self.nodes[node];
+
+            if n.bounds.hit(r, &inv, smallest) {
+                let first = n.first as usize;
+
+                if n.count > 0 {
+                    for i in first..first + n.count as usize {
+                        let t = triangle_intersect_mt(&self.tris[i], r);
+                        if t < smallest {
+                            smallest = t;
+                            index = Some(i);
+                        }
+                    }
+                } else {
+                    // Near child first so the far one is often culled by t
+                    let (near, far) = if neg[n.axis as usize] { (first, node + 1) } else { (node + 1, first) };
+                    stack[sp] = far;
+                    sp += 1;
+                    node = near;
+                    continue;
+                }
+            }
+
+            if sp == 0 {
+                break;
+            }
+            sp -= 1;
+            node = stack[sp];
+        }
+
+        index.map(|i| (smallest, i))
+    }
+}
+
+fn split(nodes: &mut Vec<Node>, boxes: &[Aabb], order: &mut [usize], first: usize) {
+    let mut bounds = Aabb::empty();
+    let mut centers = Aabb::empty();
+    for &i in order.iter() {
+        bounds.join(&boxes[i]);
+        centers.grow(&boxes[i].center());
+    }
+
+    let me = nodes.len();
+    nodes.push(Node { bounds: bounds, first: first as u32, count: order.len() as u16, axis: 0 });
+    if order.len() <= LEAF {
+        return;
+    }
+
+    let ext = centers.hi - centers.lo;
+    let axis = if ext.x >= ext.y && ext.x >= ext.z { 0 } else if ext.y >= ext.z { 1 } else { 2 };
+    let mid = order.len() / 2;
+    order.select_nth_unstable_by(mid, |&a, &b| {
+        boxes[a].center()[axis].partial_cmp(&boxes[b].center()[axis]).unwrap_or(Ordering::Equal)
+    });
+
+    let (left, right) = order.split_at_mut(mid);
+    split(nodes, boxes, left, first);
+    let right_node = nodes.len();
+    split(nodes, boxes, right, first + mid);
+
+    nodes[me].first = right_node as u32;
+    nodes[me].count = 0;
+    nodes[me].axis = axis as u16;
+}
@@ -1,12 +1,14 @@
 extern crate nalgebra as na;
 extern crate image;
-extern crate regex;
+extern crate rayon;
 use na::{Vector3};
-use image::{DynamicImage, Rgba, GenericImage};
+use image::RgbaImage;
+use rayon::prelude::*;
 use std::time::Instant;
-use std::fs::File;
-use std::io::{BufRead, BufReader};
-use regex::Regex;
+
+mod bvh;
+mod obj;
+use bvh::Bvh;
 
 const WIDTH: u32 = 800;
 const HEIGHT: u32 = 600;
@@ -14,70 +16,39 @@ const ASR: f32 = WIDTH as f32 / HEIGHT as f32;
 const FOV: f32 = 90.0;
 
 fn main() {
-    let mut triangles: Vec<Triangle> = Vec::new();
-    let mut verts: Vec<Vector3<f32>> = Vec::new();
-
-    let file = File::open("teapot.obj").expect("Unable to open file.");
-    let bfr  = BufReader::new(file);
-    let reg1 = Regex::new(r"^v\s(-?\d+.\d+)\s(-?\d+.\d+)\s(-?\d+.\d+)$").unwrap();
-    let reg2 = Regex::new(r"^f\s(\d+)\s(\d+)\s(\d+)$").unwrap();
-
-    let r_middl = new_ray(WIDTH/2, HEIGHT/2).d;
-
-    for v in bfr.lines() {
-        let line = v.expect("Unable to read line");
-        if reg1.is_match(&line) {
-            let caps = reg1.captures(&line).unwrap();
-            let vec1 = caps.get(1).map_or("", |m| m.as_str()).parse::<f32>().unwrap();
-            let vec2 = caps.get(2).map_or("", |m| m.as_str()).parse::<f32>().unwrap();
-            let vec3 = caps.get(3).map_or("", |m| m.as_str()).parse::<f32>().unwrap();
-            verts.push(Vector3::new(vec1, vec2, vec3));
-        } else if reg2.is_match(&line) {
-            let caps = reg2.captures(&line).unwrap();
-            let vec1 = caps.get(1).map_or("", |m| m.as_str()).parse::<usize>().unwrap();
-            let vec2 = caps.get(2).map_or("", |m| m.as_str()).parse::<usize>().unwrap();
-            let vec3 = caps.get(3).map_or("", |m| m.as_str()).parse::<usize>().unwrap();
-            let tri = Triangle::new(verts[vec1 - 1], verts[vec2 - 1], verts[vec3 - 1]);
-            
-            if tri.n.dot(&r_middl) < 0.0 {
-                triangles.push(tri);
-            }
-        }
-    }
-
-    let mut img = DynamicImage::new_rgba8(WIDTH, HEIGHT);
+    let load_t = Instant::now();
+    let mesh = obj::load("teapot.obj").expect("Unable to load teapot.obj");
+    let triangles: Vec<Triangle> = mesh.faces.iter()
+        .map(|f| Triangle::new(mesh.verts[f[0]], mesh.verts[f[1]], mesh.verts[f[2]]))
+        .collect();
+    let bvh = Bvh::new(triangles);
+    let load_d = load_t.elapsed();
+    println!("Time loading: {:?} ({} triangles, {} nodes)", load_d, bvh.tris.len(), bvh.nodes());
+
+    let light = Vector3::new(0.0, 0.0, 1.0).normalize();
+    let mut pixels = vec![0u8; (WIDTH * HEIGHT * 4) as usize];
     let exec_t  = Instant::now();
 
-    for x in 0..WIDTH {
-        for y in 0..HEIGHT {
-            let ray = new_ray(x, y);
-            let mut out_color = Rgba([0, 0, 0, 255]);
-            let mut smallest  = std::f32::MAX;
-            let mut index: usize = 0;
-
-            for i in 0..triangles.len() {
-                let t = triangle_intersect_mt(&triangles[i], &ray);
-                if t < smallest {
-                    smallest = t;
-                    index = i;
-                }
-            }
-
-            let light = Vector3::new(0.0, 0.0, 1.0).normalize();
+    // Rows are independent, rayon hands them out to its worker threads
+    pixels.par_chunks_mut(WIDTH as usize * 4).enumerate().for_each(|(y, row)| {
+        for x in 0..WIDTH {
+            let ray = new_ray(x, y as u32);
+            let mut out_color = [0, 0, 0, 255];
 
-            if smallest < std::f32::MAX {
-                let t_norm = triangles[index].n.normalize();
+            if let Some((_, index)) = bvh.hit(&ray) {
+                let t_norm = bvh.tris[index].n.normalize();
                 let shade = light.dot(&t_norm).abs() + 0.1;
                 let sh_cl = (255.0*shade) as u8;
-                out_color = Rgba([sh_cl, sh_cl, sh_cl, 255]);
-                // out_color = Rgba([(255.0*t_norm.x).abs() as u8, (255.0*t_norm.y).abs() as u8, (255.0*t_norm.z).abs() as u8, 255])
+                out_color = [sh_cl, sh_cl, sh_cl, 255];
             }
 
-            img.put_pixel(x, y, out_color);
+            let at = x as usize * 4;
+            row[at..at + 4].copy_from_slice(&out_color);
         }
-    }
+    });
 
     let exec_d  = exec_t.elapsed();
+    let img = RgbaImage::from_raw(WIDTH, HEIGHT, pixels).unwrap();
     img.save("img.png").unwrap();
     println!("Time rendering: {:?}", exec_d);
 }
@@ -180,5 +151,10 @@ fn triangle_intersect_mt(tri: &Triangle, ray: &Ray) -> f32 {
         return std::f32::MAX;
     }
 
-    v0_v2.dot(&q_v) * inv_det
+    let t = v0_v2.dot(&q_v) * inv_det;
+    if t < 0.0 {
+        return std::f32::MAX;
+    }
+
+    t
 }
@@ -0,0 +1,89 @@
+use na::Vector3;
+use std::fs;
+use std::io::{Error, ErrorKind, Result};
+
+// Vertices and triangles of a Wavefront OBJ file. Polygons are split into
+// fans; texture and normal indices are ignored.
+pub struct Mesh {
+    pub verts: Vec<Vector3<f32>>,
+    pub faces: Vec<[usize; 3]>
+}
+
+// Whitespace separated words of one line, without copying it
+struct Words<'a> {
+    line: &'a [u8],
+    at: usize
+}
+
+impl<'a> Iterator for Words<'a> {
+    type Item = &'a [u8];
+
+    fn next(&mut self) -> Option<&'a [u8]> {
+        let line = self.line;
+        while self.at < line.len() && is_space(line[self.at]) {
+            self.at += 1;
+        }
+        let start = self.at;
+        while self.at < line.len() && !is_space(line[self.at]) {
+            self.at += 1;
+        }
+
+        if start < self.at { Some(&line[start..self.at]) } else { None }
+    }
+}
+
+fn is_space(b: u8) -> bool {
+    b == b' ' || b == b'\t' || b == b'\r'
+}
+
+fn parse_f32(word: &[u8]) -> Option<f32> {
+    std::str::from_utf8(word).ok()?.parse::<f32>().ok()
+}
+
+// "7", "7/2" or "7//3", negative indices count back from the last vertex
+fn parse_index(word: &[u8], verts: usize) -> Option<usize> {
+    let end = word.iter().position(|&b| b == b'/').unwrap_or(word.len());
+    let i = std::str::from_utf8(&word[..end]).ok()?.parse::<i64>().ok()?;
+    let i = if i < 0 { verts as i64 + i } else { i - 1 };
+
+    if i >= 0 && i < verts as i64 { Some(i as usize) } else { None }
+}
+
+fn bad_line(path: &str, line: usize, what: &str) -> Error {
+    Error::new(ErrorKind::InvalidData, format!("{}:{}: bad {}", path, line + 1, what))
+}
+
+pub fn load(path: &str) -> Result<Mesh> {
+    let data = fs::read(path)?;
+    let mut mesh = Mesh { verts: Vec::new(), faces: Vec::new() };
+    let mut poly: Vec<usize> = Vec::new();
+
+    for (n, line) in data.split(|&b| b == b'\n').enumerate() {
+        let mut words = Words { line: line, at: 0 };
+
+        match words.next() {
+            Some(b"v") => {
+                let mut v = [0.0; 3];
+                for c in v.iter_mut() {
+                    *c = words.next().and_then(parse_f32).ok_or_else(|| bad_line(path, n, "vertex"))?;
+                }
+                mesh.verts.push(Vector3::new(v[0], v[1], v[2]));
+            }
+            Some(b"f") => {
+                poly.clear();
+                for w in words {
+                    poly.push(parse_index(w, mesh.verts.len()).ok_or_else(|| bad_line(path, n, "face"))?);
+                }
+                if poly.len() < 3 {
+                    return Err(bad_line(path, n, "face"));
+                }
+                for k in 1..poly.len() - 1 {
+                    mesh.faces.push([poly[0], poly[k], poly[k + 1]]);
+                }
+            }
+            _ => {}
+        }
+    }
+
+    Ok(mesh)
+}
@@ -15,74 +15,294 @@ const GAMMA: f32 = 2.2;
 const MAX_STEPS: u32 = 100;
 const SURF_DIST: f32 = 0.01;
 const MAX_DIST : f32 = 100.0;
+// Over-relaxation factor for sphere tracing, steps are this much longer than
+// the distance bound until one overshoots
+const RELAX: f32 = 1.6;
+// Step count shown white in steps.png
+const HEAT_STEPS: u32 = 32;
+// Tile sizes of the cone passes, coarsest first, each a multiple of the next
+const CONES: [u32; 2] = [8, 4];
 
 fn main() {
     let mut img: DynamicImage = DynamicImage::new_rgba8(WIDTH, HEIGHT);
-    let light_pos = Vector3::new(0.0, 0.0, 0.0);
+    let mut heat: DynamicImage = DynamicImage::new_rgba8(WIDTH, HEIGHT);
+    let light_pos = Vector3::new(1.0, 2.0, 1.0);
+    let scene = vec![
+        Prim::new(Vector3::new(1.0, 0.25, -1.0), Shape::Box(Vector3::new(0.1, 0.1, 0.1))),
+        Prim::new(Vector3::new(0.5, 0.0, -1.0), Shape::Box(Vector3::new(0.25, 0.1, 0.1))),
+        Prim::new(Vector3::new(0.0, 0.0, -1.0), Shape::Cylinder(Vector2::new(1.0, 0.25)))
+    ];
+    let mut active = Vec::with_capacity(scene.len());
+    let mut total_steps: u64 = 0;
+    let mut cone_evals: u64 = 0;
+    let mut evals: u64 = 0;
 
     let exec_time = Instant::now();
+
+    // Each pass starts its cones where the coarser pass stopped
+    let mut seeds: Vec<f32> = Vec::new();
+    let mut seed_size = 0;
+    for &size in CONES.iter() {
+        seeds = cone_pass(&scene, size, &seeds, seed_size, &mut active, &mut cone_evals);
+        seed_size = size;
+    }
+    let seed_cols = (WIDTH + seed_size - 1) / seed_size;
+
     for y in 0..HEIGHT {
         for x in 0..WIDTH {
             let ray = Ray::new(x as f32, y as f32);
             let mut col = Vector3::new(0.0, 0.0, 0.0);
 
-            let hit = march(&ray);
+            let start = seeds[((y / seed_size) * seed_cols + x / seed_size) as usize];
+            let (hit, steps) = march(&scene, &ray, start, &mut active);
+            evals += steps as u64;
             if hit < MAX_DIST {
+                evals += 4;
                 // col = Vector3::new(hit, hit, hit)/8.0;
                 let p = ray.o + ray.d * hit;
                 let light_d = -(p - light_pos).normalize();
-                let normal = estimate_normal(&p);
+                let normal = estimate_normal(&scene, &p);
                 let diff_ints = normal.dot(&light_d).max(0.0);
                 col = Vector3::new(1.0, 0.0, 0.0) * diff_ints;
             }
             img.put_pixel(x, y, to_rgba(&col));
+            heat.put_pixel(x, y, heat_rgba(steps));
+            total_steps += steps as u64;
         }
     }
     let exec_dur = exec_time.elapsed();
 
     img.save("out.png").unwrap();
+    heat.save("steps.png").unwrap();
     println!("Time rendering: {:?}", exec_dur);
+    println!("Steps per pixel: {:.2}", total_steps as f64 / (WIDTH * HEIGHT) as f64);
+    println!("SDF evaluations: {} ({} in cones)", evals + cone_evals, cone_evals);
 }
 
-fn march(r: &Ray) -> f32 {
-    let mut d_o: f32 = 0.0;
+// Marches one cone per size x size tile. A tile's cone follows the ray
+// through its middle and is wide enough to hold the rays of all its pixels.
+// Returns the distances every ray of a tile can safely start from, row by
+// row; cones start from the seeds of the enclosing tiles of the previous
+// pass when there is one.
+fn cone_pass<'a>(scene: &'a [Prim], size: u32, seeds: &[f32], seed_size: u32,
+                 active: &mut Vec<&'a Prim>, evals: &mut u64) -> Vec<f32> {
+    let cols = (WIDTH + size - 1) / size;
+    let rows = (HEIGHT + size - 1) / size;
+    let mut out = Vec::with_capacity((cols * rows) as usize);
+
+    for ty in 0..rows {
+        for tx in 0..cols {
+            let x0 = (tx * size) as f32;
+            let y0 = (ty * size) as f32;
+            let x1 = ((tx + 1) * size).min(WIDTH) as f32 - 1.0;
+            let y1 = ((ty + 1) * size).min(HEIGHT) as f32 - 1.0;
+            let mid = Ray::new((x0 + x1) * 0.5, (y0 + y1) * 0.5);
+
+            // The corner rays are the furthest from the middle one
+            let mut spread: f32 = 0.0;
+            for &(x, y) in [(x0, y0), (x1, y0), (x0, y1), (x1, y1)].iter() {
+                spread = max(spread, (Ray::new(x, y).d - mid.d).magnitude());
+            }
+
+            let start = if seeds.is_empty() {
+                0.0
+            } else {
+                let seed_cols = (WIDTH + seed_size - 1) / seed_size;
+                seeds[((ty * size / seed_size) * seed_cols + tx * size / seed_size) as usize]
+            };
+            out.push(cone_march(scene, &mid, spread * 1.001, start, active, evals));
+        }
+    }
+
+    out
+}
+
+// A ray whose direction is within spread of r.d is, at distance t, within
+// t * spread of r's point at t. While the scene distance at r's point beats
+// that by more than SURF_DIST, the step below keeps every such ray out of
+// reach of a hit, so skipping it cannot change what march() finds. Cones
+// that leave the last bounding sphere return past MAX_DIST.
+fn cone_march<'a>(scene: &'a [Prim], r: &Ray, spread: f32, start: f32,
+                  active: &mut Vec<&'a Prim>, evals: &mut u64) -> f32 {
+    let (t_in, t_out) = cull(scene, r, spread, active);
+    if active.is_empty() || start > t_out {
+        return 2.0 * MAX_DIST;
+    }
+    let mut t = max(t_in, start);
 
     for _ in 0..MAX_STEPS {
-        let p: Vector3<f32> = r.o + r.d * d_o;
-        let d_s = scene_sdf(&p);
-        d_o += d_s;
-        if d_s < SURF_DIST || d_o > MAX_DIST {
+        if t > t_out {
+            return 2.0 * MAX_DIST;
+        }
+
+        let free = scene_sdf(active.iter().copied(), &(r.o + r.d * t)) - t * spread - SURF_DIST;
+        *evals += 1;
+        if free < SURF_DIST {
             break;
         }
+        t += free / (1.0 + spread);
+    }
+
+    t
+}
+
+// Over-relaxed sphere tracing (Keinert et al. 2014). Only primitives whose
+// bounding sphere the ray passes through are evaluated, and the march runs
+// from where the ray enters the first of those spheres, or from start when
+// the cone passes got further, to where it leaves the last. Each step is
+// RELAX times the distance bound; once two consecutive distance spheres
+// stop overlapping, or a step leaves the last sphere, the last step may
+// have jumped a surface, so it is taken back and the march continues
+// unrelaxed.
+// Returns the distance and the number of steps taken.
+fn march<'a>(scene: &'a [Prim], r: &Ray, start: f32, active: &mut Vec<&'a Prim>) -> (f32, u32) {
+    let (t_in, t_out) = cull(scene, r, 0.0, active);
+    if active.is_empty() || start > t_out {
+        return (MAX_DIST, 0);
+    }
+
+    let mut d_o: f32 = max(t_in, start);
+    let mut omega = RELAX;
+    let mut prev_d: f32 = 0.0;
+    let mut step: f32 = 0.0;
+
+    for i in 0..MAX_STEPS {
+        let p: Vector3<f32> = r.o + r.d * d_o;
+        let d_s = scene_sdf(active.iter().copied(), &p);
+
+        if omega > 1.0 && d_s.abs() + prev_d < step {
+            d_o -= step;
+            step = prev_d;
+            omega = 1.0;
+            d_o += step;
+            continue;
+        }
+
+        if d_s < SURF_DIST {
+            return (d_o + d_s, i + 1);
+        }
+        step = d_s * omega;
+        prev_d = d_s.abs();
+        d_o += step;
+        if d_o > t_out {
+            // A relaxed step may have jumped a surface just before t_out,
+            // only an unrelaxed one proves the ray got out
+            if omega > 1.0 {
+                d_o -= step;
+                step = prev_d;
+                omega = 1.0;
+                d_o += step;
+                continue;
+            }
+            return (MAX_DIST, i + 1);
+        }
     }
 
-    d_o
+    // Out of steps without reaching a surface is a miss
+    (MAX_DIST, MAX_STEPS)
 }
 
-fn estimate_normal(p: &Vector3<f32>) -> Vector3<f32> {
-    return Vector3::new(
-        scene_sdf(&Vector3::new(p.x + SURF_DIST, p.y, p.z)) - scene_sdf(&Vector3::new(p.x - SURF_DIST, p.y, p.z)),
-        scene_sdf(&Vector3::new(p.x, p.y + SURF_DIST, p.z)) - scene_sdf(&Vector3::new(p.x, p.y - SURF_DIST, p.z)),
-        scene_sdf(&Vector3::new(p.x, p.y, p.z + SURF_DIST)) - scene_sdf(&Vector3::new(p.x, p.y, p.z - SURF_DIST))
-    ).normalize();
+// Collects the primitives whose bounding sphere the ray, or the cone of the
+// given spread around it, passes through. Returns the part of the ray
+// between entering the first and leaving the last.
+fn cull<'a>(scene: &'a [Prim], r: &Ray, spread: f32, active: &mut Vec<&'a Prim>) -> (f32, f32) {
+    let mut t_in = MAX_DIST;
+    let mut t_out: f32 = 0.0;
+
+    active.clear();
+    for prim in scene {
+        if let Some((t0, t1)) = prim.span(r, spread) {
+            active.push(prim);
+            t_in = min(t_in, t0);
+            t_out = max(t_out, t1);
+        }
+    }
+
+    (t_in, min(t_out, MAX_DIST))
 }
 
-fn scene_sdf(p: &Vector3<f32>) -> f32 {
-    let b1 = Vector3::new(0.1, 0.1, 0.1);
+// Tetrahedral central differences, four SDF taps instead of six
+fn estimate_normal(scene: &[Prim], p: &Vector3<f32>) -> Vector3<f32> {
+    let k0 = Vector3::new(1.0, -1.0, -1.0);
+    let k1 = Vector3::new(-1.0, -1.0, 1.0);
+    let k2 = Vector3::new(-1.0, 1.0, -1.0);
+    let k3 = Vector3::new(1.0, 1.0, 1.0);
+
+    return (k0 * scene_sdf(scene, &(p + k0 * SURF_DIST)) +
+            k1 * scene_sdf(scene, &(p + k1 * SURF_DIST)) +
+            k2 * scene_sdf(scene, &(p + k2 * SURF_DIST)) +
+            k3 * scene_sdf(scene, &(p + k3 * SURF_DIST))).normalize();
+}
+
+enum Shape {
+    // Half extents
+    Box(Vector3<f32>),
+    // Radius and half height, upright
+    Cylinder(Vector2<f32>)
+}
+
+struct Prim {
+    c: Vector3<f32>,
+    shape: Shape,
+    // Radius of a sphere around c that holds the whole primitive
+    bound: f32
+}
+
+impl Prim {
+    fn new(c: Vector3<f32>, shape: Shape) -> Self {
+        let bound = match &shape {
+            Shape::Box(b) => b.magnitude(),
+            Shape::Cylinder(h) => h.magnitude()
+        };
+
+        Prim { c: c, shape: shape, bound: bound }
+    }
+
+    // Where r enters and leaves the bounding sphere, None when it misses or
+    // the sphere is behind it. For a cone around r the sphere grows by the
+    // cone's radius at its far side.
+    fn span(&self, r: &Ray, spread: f32) -> Option<(f32, f32)> {
+        let q: Vector3<f32> = self.c - r.o;
+        let b = q.dot(&r.d);
+        let bound = self.bound + spread * (q.magnitude() + self.bound);
+        let h2 = bound * bound - (q.dot(&q) - b * b);
+        if h2 < 0.0 {
+            return None;
+        }
+
+        let h = h2.sqrt();
+        if b + h < 0.0 { None } else { Some((max(b - h, 0.0), b + h)) }
+    }
 
-    let q1: Vector3<f32> = (p - Vector3::new(1.0, 0.25, -1.0)).abs() - b1;
-    let d1 = q1.sup(&Vector3::new(0.0, 0.0, 0.0)).magnitude();
-    
-    let b2 = Vector3::new(0.25, 0.1, 0.1);
+    fn sdf(&self, q: &Vector3<f32>) -> f32 {
+        match &self.shape {
+            Shape::Box(b) => {
+                let q1: Vector3<f32> = q.abs() - b;
+                q1.sup(&Vector3::new(0.0, 0.0, 0.0)).magnitude()
+            }
+            Shape::Cylinder(h) => {
+                let q3: Vector2<f32> = Vector2::new(Vector2::new(q.x, q.z).magnitude(), q.y).abs() - h;
+                min(max(q3.x, q3.y), 0.0) + q3.sup(&(Vector2::new(0.0, 0.0))).magnitude()
+            }
+        }
+    }
+}
 
-    let q2: Vector3<f32> = (p - Vector3::new(0.5, 0.0, -1.0)).abs() - b2;
-    let d2 = q2.sup(&Vector3::new(0.0, 0.0, 0.0)).magnitude();
+// Distance to the closest of prims. The distance to a bounding sphere never
+// exceeds the distance to what it holds, so primitives whose sphere is
+// further than the best distance so far are skipped without changing the
+// result.
+fn scene_sdf<'a>(prims: impl IntoIterator<Item = &'a Prim>, p: &Vector3<f32>) -> f32 {
+    let mut d = std::f32::MAX;
 
-    let cyl_p: Vector3<f32> = p - Vector3::new(0.0, 0.0, -1.0);
-    let q3: Vector2<f32> = Vector2::new(Vector2::new(cyl_p.x, cyl_p.z).magnitude(), cyl_p.y).abs() - Vector2::new(1.0, 0.25);
-    let d3 = min(max(q3.x, q3.y), 0.0) + q3.sup(&(Vector2::new(0.0, 0.0))).magnitude();
+    for prim in prims {
+        let q: Vector3<f32> = p - prim.c;
+        if q.magnitude() - prim.bound < d {
+            d = min(d, prim.sdf(&q));
+        }
+    }
 
-    min(min(d1, d2), d3)
+    d
 }
 
 struct Ray {
@@ -97,7 +317,7 @@ impl Ray {
         let r_y: f32 = (1.0 - ((y + 0.5) / HEIGHT as f32) * 2.0) * fov;
 
         Ray {
-            o: Vector3::new(0.0, 0.0, 0.0),
+            o: Vector3::new(0.0, 1.0, 1.5),
             d: Vector3::new(r_x, r_y, -1.0).normalize()
         }
     }
@@ -112,6 +332,18 @@ fn to_rgba(c: &Vector3<f32>) -> Rgba<u8> {
     ])
 }
 
+// Black through red and yellow to white as the step count goes to HEAT_STEPS
+fn heat_rgba(steps: u32) -> Rgba<u8> {
+    let t = 3.0 * steps as f32 / HEAT_STEPS as f32;
+
+    Rgba([
+        (t.min(1.0) * 255.0) as u8,
+        ((t - 1.0).max(0.0).min(1.0) * 255.0) as u8,
+        ((t - 2.0).max(0.0).min(1.0) * 255.0) as u8,
+        255
+    ])
+}
+
 fn gamma_encode(l: f32) -> f32 {
     l.powf(1.0/GAMMA)
 }
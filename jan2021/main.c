@@ -9,7 +9,7 @@
 #define GAMMA 2.2
 
 #define DBL_MAX 1.7976931348623158e+308
-#define RAND_MAX 0x7fff
+#define SEED 1
 
 #define to_radians(angle) ((angle) * M_PI / 180.0)
 #define to_rgb(f) (f >= 1.0 ? 255 : (f <= 0.0 ? 0 : (int)floor(f * 256.0)))
@@ -18,10 +18,14 @@
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
+#include "sampler.h"
+
 enum { WIDTH = 800, HEIGHT = 600 };
 const double FOV = 90.0;
 const double A_R = (double)WIDTH/(double)HEIGHT;
 const int    SS  = 10;
+/* Neighbours further apart than this in any channel mark an edge pixel */
+const double CONTRAST = 0.05;
 
 struct Vec3
 {
@@ -114,6 +118,16 @@ int ray_hit(struct Ray *r, struct Sphere *objs[], int objs_len, struct Sphere *o
 
 void swap(double*, double*);
 
+struct Vec3 trace(double x, double y, struct Sphere *objs[], int objs_len, struct Sphere *light);
+
+double contrast(struct Vec3 *a, struct Vec3 *b);
+
+/* First pass colours, one ray through every pixel centre */
+static struct Vec3 centre[WIDTH*HEIGHT];
+/* Set for pixels that contrast with their right or lower neighbour, or are
+ * that neighbour */
+static unsigned char edge[WIDTH*HEIGHT];
+
 double gamma_encode(double a)
 {
 	return pow(a, 1.0/GAMMA);
@@ -124,11 +138,6 @@ void print_vec3(struct Vec3 *a)
 	printf("[%f, %f, %f]\n", a->x, a->y, a->z);
 }
 
-double rand_2()
-{
-	return (double)rand() / (double)RAND_MAX;
-}
-
 int main(void)
 {
 	unsigned char data[WIDTH*HEIGHT*3+(WIDTH*4)];
@@ -139,37 +148,66 @@ int main(void)
 	struct Sphere *scene_spheres[] = {&sp, &sp2};
 	int scene_spheres_len = 2;
 
+	long rays = 0;
+	int refined = 0;
+
 	clock_t begin = clock();
 
+	for (int y = 0; y < HEIGHT; y++)
+		for (int x = 0; x < WIDTH; x++)
+			centre[WIDTH * y + x] = trace(x, y, scene_spheres, scene_spheres_len, &light);
+	rays += WIDTH * HEIGHT;
+
 	for (int y = 0; y < HEIGHT; y++)
 	{
 		for (int x = 0; x < WIDTH; x++)
 		{
-			struct Vec3 out_col = {0.0, 0.0, 0.0};
-
-			// for (int s = 0; s < SS; s++)
-			// {
-				struct Ray ray = create_ray(x, y);
-				// struct Ray ray = create_ray((double)x + rand_2(), (double)y + rand_2());
+			int i = WIDTH * y + x;
 
-				struct Sphere obj;
-				double t = DBL_MAX;
+			if (x + 1 < WIDTH && contrast(&centre[i], &centre[i + 1]) > CONTRAST)
+				edge[i] = edge[i + 1] = 1;
+			if (y + 1 < HEIGHT && contrast(&centre[i], &centre[i + WIDTH]) > CONTRAST)
+				edge[i] = edge[i + WIDTH] = 1;
+		}
+	}
 
-				if (ray_hit(&ray, scene_spheres, scene_spheres_len, &obj, &t))
+	for (int y = 0; y < HEIGHT; y++)
+	{
+		for (int x = 0; x < WIDTH; x++)
+		{
+			struct Vec3 out_col = centre[WIDTH * y + x];
+			struct Vec3 lo = out_col, hi = out_col;
+
+			/*
+			 * Only pixels that differ from a neighbour get more rays. They are
+			 * spread over the pixel by its scrambled Sobol points; once four samples
+			 * agree the pixel is taken as settled, otherwise it gets up to SS.
+			 */
+			int n = 1;
+			if (edge[WIDTH * y + x])
+			{
+				for (; n < SS; n++)
 				{
-					struct Vec3 dist = vec3_scale(&ray.d, t);
-					struct Vec3 hit_p = vec3_add(&ray.o, &dist);
-					struct Vec3 norml = sphere_normal(&obj, &hit_p);
-					struct Vec3 light_v = vec3_sub(&light.o, &hit_p);
-					struct Vec3 light_n = vec3_norm(&light_v);
-					double l_int = vec3_dot(&norml, &light_n) * light.r / pow(vec3_mag(&light_v), 2.0);
-					struct Vec3 col = vec3_scale(&(obj.color), l_int);
-					vec3_apply(&col, &gamma_encode);
+					if (n == 4 && contrast(&lo, &hi) <= CONTRAST)
+						break;
+
+					double u, v;
+					// Sample 0 is the centre ray, so the extra rays start at point 0
+					sampler_get2(SEED, WIDTH * y + x, n - 1, DIM_PIXEL, &u, &v);
+					struct Vec3 col = trace(x + u - 0.5, y + v - 0.5, scene_spheres, scene_spheres_len, &light);
+
 					out_col = vec3_add(&out_col, &col);
+					lo.x = fmin(lo.x, col.x);
+					lo.y = fmin(lo.y, col.y);
+					lo.z = fmin(lo.z, col.z);
+					hi.x = fmax(hi.x, col.x);
+					hi.y = fmax(hi.y, col.y);
+					hi.z = fmax(hi.z, col.z);
 				}
-			// }
-
-			// out_col = vec3_div(&out_col, SS);
+				out_col = vec3_div(&out_col, n);
+				rays += n - 1;
+				refined++;
+			}
 
 			int pos = (WIDTH * 3 * y) + (3 * x);
 
@@ -184,6 +222,8 @@ int main(void)
 	stbi_write_png("out.png", WIDTH, HEIGHT, 3, data, WIDTH*3);
 
 	printf("Time rendering: %f s\n", (double)(end - begin)/CLOCKS_PER_SEC);
+	printf("Rays per pixel: %.3f (%d uniformly), %.2f%% of pixels refined\n",
+		   (double)rays / (WIDTH * HEIGHT), SS, 100.0 * refined / (WIDTH * HEIGHT));
 
 	return 0;
 }
@@ -206,6 +246,36 @@ struct Ray create_ray(double x, double y)
 	return out;
 }
 
+/* Gamma encoded colour seen through image position (x, y), pixel centres at
+ * whole numbers */
+struct Vec3 trace(double x, double y, struct Sphere *objs[], int objs_len, struct Sphere *light)
+{
+	struct Vec3 col = {0.0, 0.0, 0.0};
+	struct Ray ray = create_ray(x, y);
+	struct Sphere obj;
+	double t = DBL_MAX;
+
+	if (ray_hit(&ray, objs, objs_len, &obj, &t))
+	{
+		struct Vec3 dist = vec3_scale(&ray.d, t);
+		struct Vec3 hit_p = vec3_add(&ray.o, &dist);
+		struct Vec3 norml = sphere_normal(&obj, &hit_p);
+		struct Vec3 light_v = vec3_sub(&light->o, &hit_p);
+		struct Vec3 light_n = vec3_norm(&light_v);
+		double l_int = vec3_dot(&norml, &light_n) * light->r / pow(vec3_mag(&light_v), 2.0);
+		col = vec3_scale(&(obj.color), l_int);
+		vec3_apply(&col, &gamma_encode);
+	}
+
+	return col;
+}
+
+/* Largest difference between a and b in any channel */
+double contrast(struct Vec3 *a, struct Vec3 *b)
+{
+	return fmax(fmax(fabs(a->x - b->x), fabs(a->y - b->y)), fabs(a->z - b->z));
+}
+
 int ray_hit(struct Ray *r, struct Sphere *objs[], int objs_len, struct Sphere *obj, double *t)
 {
 	int hit = 0;
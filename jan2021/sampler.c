@@ -0,0 +1,146 @@
+#include "sampler.h"
+
+/* Joe-Kuo direction numbers of the first four Sobol dimensions */
+static const uint32_t SOBOL[4][32] = {
+	{
+		0x80000000, 0x40000000, 0x20000000, 0x10000000, 0x08000000, 0x04000000, 0x02000000, 0x01000000,
+		0x00800000, 0x00400000, 0x00200000, 0x00100000, 0x00080000, 0x00040000, 0x00020000, 0x00010000,
+		0x00008000, 0x00004000, 0x00002000, 0x00001000, 0x00000800, 0x00000400, 0x00000200, 0x00000100,
+		0x00000080, 0x00000040, 0x00000020, 0x00000010, 0x00000008, 0x00000004, 0x00000002, 0x00000001
+	},
+	{
+		0x80000000, 0xc0000000, 0xa0000000, 0xf0000000, 0x88000000, 0xcc000000, 0xaa000000, 0xff000000,
+		0x80800000, 0xc0c00000, 0xa0a00000, 0xf0f00000, 0x88880000, 0xcccc0000, 0xaaaa0000, 0xffff0000,
+		0x80008000, 0xc000c000, 0xa000a000, 0xf000f000, 0x88008800, 0xcc00cc00, 0xaa00aa00, 0xff00ff00,
+		0x80808080, 0xc0c0c0c0, 0xa0a0a0a0, 0xf0f0f0f0, 0x88888888, 0xcccccccc, 0xaaaaaaaa, 0xffffffff
+	},
+	{
+		0x80000000, 0xc0000000, 0x60000000, 0x90000000, 0xe8000000, 0x5c000000, 0x8e000000, 0xc5000000,
+		0x68800000, 0x9cc00000, 0xee600000, 0x55900000, 0x80680000, 0xc09c0000, 0x60ee0000, 0x90550000,
+		0xe8808000, 0x5cc0c000, 0x8e606000, 0xc5909000, 0x6868e800, 0x9c9c5c00, 0xeeee8e00, 0x5555c500,
+		0x8000e880, 0xc0005cc0, 0x60008e60, 0x9000c590, 0xe8006868, 0x5c009c9c, 0x8e00eeee, 0xc5005555
+	},
+	{
+		0x80000000, 0xc0000000, 0x20000000, 0x50000000, 0xf8000000, 0x74000000, 0xa2000000, 0x93000000,
+		0xd8800000, 0x25400000, 0x59e00000, 0xe6d00000, 0x78080000, 0xb40c0000, 0x82020000, 0xc3050000,
+		0x208f8000, 0x51474000, 0xfbea2000, 0x75d93000, 0xa0858800, 0x914e5400, 0xdbe79e00, 0x25db6d00,
+		0x58800080, 0xe54000c0, 0x79e00020, 0xb6d00050, 0x800800f8, 0xc00c0074, 0x200200a2, 0x50050093
+	}
+};
+
+static uint64_t rotl(uint64_t x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t splitmix64(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ull);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
+
+/* 32 bit integer hash with good avalanche (lowbias32) */
+static uint32_t hash32(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+static uint32_t hash_combine(uint32_t seed, uint32_t v)
+{
+	return seed ^ (v + (seed << 6) + (seed >> 2));
+}
+
+void rng_seed(struct Rng *r, uint64_t seed)
+{
+	for (int i = 0; i < 4; i++)
+		r->s[i] = splitmix64(&seed);
+}
+
+void rng_stream(struct Rng *r, uint64_t seed, uint32_t pixel, uint32_t sample)
+{
+	rng_seed(r, seed ^ (((uint64_t)pixel << 32 | sample) * 0xd1342543de82ef95ull));
+}
+
+uint64_t rng_next(struct Rng *r)
+{
+	uint64_t *s = r->s;
+	uint64_t out = rotl(s[1] * 5, 7) * 9;
+	uint64_t t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 45);
+
+	return out;
+}
+
+double rng_double(struct Rng *r)
+{
+	return (double)(rng_next(r) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint32_t reverse_bits(uint32_t x)
+{
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+	x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+/*
+ * Owen scrambling as a hash (Burley 2020): every bit is flipped depending on
+ * the bits above it, which keeps the Sobol strata intact
+ */
+static uint32_t owen_scramble(uint32_t x, uint32_t seed)
+{
+	x = reverse_bits(x);
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return reverse_bits(x);
+}
+
+static uint32_t sobol(uint32_t index, int dim)
+{
+	uint32_t x = 0;
+
+	for (int bit = 0; index != 0; bit++, index >>= 1)
+		if (index & 1)
+			x ^= SOBOL[dim][bit];
+
+	return x;
+}
+
+static double sobol_point(uint32_t seed, uint32_t pixel, uint32_t sample, int dim)
+{
+	/* Each group of four dimensions shuffles the pixel's samples its own way */
+	uint32_t key = hash32(hash_combine(hash32(seed ^ pixel * 0x9e3779b9u), (uint32_t)(dim / 4)));
+	uint32_t index = owen_scramble(sample, key);
+	uint32_t x = owen_scramble(sobol(index, dim % 4), hash_combine(key, (uint32_t)(dim % 4)));
+
+	return (double)x * (1.0 / 4294967296.0);
+}
+
+double sampler_get(uint32_t seed, uint32_t pixel, uint32_t sample, int dim)
+{
+	return sobol_point(seed, pixel, sample, dim);
+}
+
+void sampler_get2(uint32_t seed, uint32_t pixel, uint32_t sample, int dim, double *u, double *v)
+{
+	*u = sobol_point(seed, pixel, sample, dim);
+	*v = sobol_point(seed, pixel, sample, dim + 1);
+}
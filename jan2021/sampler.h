@@ -0,0 +1,44 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <stdint.h>
+
+/*
+ * Random numbers for the renderer. Everything here is a pure function of a
+ * seed and the (pixel, sample) being traced, so an image comes out the same
+ * whichever thread traces which pixel and in what order.
+ */
+
+/* xoshiro256** state, one per thread or per (pixel, sample) stream */
+struct Rng
+{
+	uint64_t s[4];
+};
+
+void rng_seed(struct Rng *r, uint64_t seed);
+
+/* Independent stream for one sample of one pixel */
+void rng_stream(struct Rng *r, uint64_t seed, uint32_t pixel, uint32_t sample);
+
+uint64_t rng_next(struct Rng *r);
+
+/* Uniform in [0, 1) */
+double rng_double(struct Rng *r);
+
+/*
+ * Sample dimensions, in pairs. Only the two dimensions of a named pair are
+ * stratified together: the first 16 points of a pixel fill a 4x4 grid of
+ * each pair. Other combinations of dimensions are not. Each group of four
+ * dimensions has its own scramble.
+ */
+enum { DIM_PIXEL = 0, DIM_LENS = 2, DIM_LIGHT = 4, DIM_TIME = 6 };
+
+/* Point number sample of the pixel's own scrambled Sobol sequence, in
+ * [0, 1). Any power of two prefix of a pixel's samples covers every
+ * dimension evenly. */
+double sampler_get(uint32_t seed, uint32_t pixel, uint32_t sample, int dim);
+
+/* Dimensions dim and dim + 1 at once, dim even */
+void sampler_get2(uint32_t seed, uint32_t pixel, uint32_t sample, int dim, double *u, double *v);
+
+#endif
@@ -0,0 +1,128 @@
+#include "anim.h"
+#include "parser.h"
+#include <stdlib.h>
+#include <string.h>
+
+int animAdd(Anim *a, Key k)
+{
+	if (a->keysLen == a->keysCap)
+	{
+		int cap = (a->keysCap > 0) ? a->keysCap * 2 : 16;
+		Key *keys = realloc(a->keys, sizeof(Key) * cap);
+		if (keys == NULL)
+			return 0;
+		a->keys = keys;
+		a->keysCap = cap;
+	}
+
+	a->keys[a->keysLen++] = k;
+	return 1;
+}
+
+void animFree(Anim *a)
+{
+	free(a->keys);
+	a->keys = NULL;
+	a->keysLen = a->keysCap = 0;
+}
+
+static int keyCmp(const void *a, const void *b)
+{
+	const Key *ka = a, *kb = b;
+
+	if (ka->target != kb->target)
+		return (ka->target > kb->target) - (ka->target < kb->target);
+	return (ka->frame > kb->frame) - (ka->frame < kb->frame);
+}
+
+void animSort(Anim *a)
+{
+	if (a->keysLen > 1)
+		qsort(a->keys, a->keysLen, sizeof(Key), keyCmp);
+}
+
+Vec3 animAt(const Anim *a, int target, int frame, Vec3 rest)
+{
+	int i = 0;
+
+	while (i < a->keysLen && a->keys[i].target != target)
+		i++;
+	if (i == a->keysLen)
+		return rest;
+
+	// Last key of target at or before frame, or its first key
+	while (i + 1 < a->keysLen && a->keys[i + 1].target == target && a->keys[i + 1].frame <= frame)
+		i++;
+
+	const Key *k0 = &a->keys[i], *k1 = &a->keys[i + 1];
+	if (frame <= k0->frame || i + 1 == a->keysLen || k1->target != target)
+		return k0->o;
+
+	double f = (double)(frame - k0->frame) / (double)(k1->frame - k0->frame);
+	Vec3 d = sub((Vec3 *)&k1->o, (Vec3 *)&k0->o);
+	d = scale(&d, f);
+
+	return add((Vec3 *)&k0->o, &d);
+}
+
+int animPose(const Scene *base, int frame, Scene *out)
+{
+	*out = *base;
+	out->bvh = (Bvh){0};
+	out->soa = (SceneSoA){0};
+	out->objs = malloc(sizeof(Object) * (base->objsLen > 0 ? base->objsLen : 1));
+	if (out->objs == NULL)
+		return 0;
+	memcpy(out->objs, base->objs, sizeof(Object) * base->objsLen);
+
+	// Spheres and planes both keep their origin first
+	for (int i = 0; i < base->objsLen; i++)
+		out->objs[i].obj.sp.o = animAt(&base->anim, i, frame, base->objs[i].obj.sp.o);
+	out->li.o = animAt(&base->anim, KEY_LIGHT, frame, base->li.o);
+
+	if (!bvhBuild(&out->bvh, out->objs, out->objsLen, out->kern->lanes) ||
+		!soaBuild(&out->soa, out->objs, &out->bvh))
+		return 0;
+
+	return 1;
+}
+
+void animRelease(Scene *s)
+{
+	soaFree(&s->soa);
+	bvhFree(&s->bvh);
+	free(s->objs);
+	s->objs = NULL;
+}
+
+typedef struct PoseJob {
+	const Scene *base;
+	int first;
+	Scene *out;
+	_Atomic int failed;
+} PoseJob;
+
+static void poseFrame(void *ctx, int task, int worker)
+{
+	PoseJob *job = ctx;
+	(void)worker;
+
+	if (!animPose(job->base, job->first + task, &job->out[task]))
+		job->failed = 1;
+}
+
+int animPoseFrames(const Scene *base, int first, int n, Scene *out, Sched *pool)
+{
+	PoseJob job = {base, first, out, 0};
+
+	schedRun(pool, n, poseFrame, &job);
+
+	if (job.failed)
+	{
+		for (int i = 0; i < n; i++)
+			animRelease(&out[i]);
+		return 0;
+	}
+
+	return 1;
+}
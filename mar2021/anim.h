@@ -0,0 +1,46 @@
+#ifndef ANIM_H
+#define ANIM_H
+#include "obj.h"
+#include "sched.h"
+
+// Keyframe target of the light, objects are addressed by their index
+enum { KEY_LIGHT = -1 };
+
+typedef struct Key {
+	int target;
+	int frame;
+	Vec3 o;
+} Key;
+
+// Frame count, per frame delay (1/100 s) and the origin keyframes of a
+// scene. Origins are interpolated linearly between keys and held before the
+// first and after the last one.
+typedef struct Anim {
+	int frames;
+	int delay;
+	Key *keys;
+	int keysLen;
+	int keysCap;
+} Anim;
+
+int animAdd(Anim *a, Key k);
+void animFree(Anim *a);
+
+// Sorts the keys by target and frame, call once after the last animAdd()
+void animSort(Anim *a);
+
+// Origin of target at frame, rest when the target has no keys
+Vec3 animAt(const Anim *a, int target, int frame, Vec3 rest);
+
+struct Scene;
+
+// Fills out with base moved to frame, with its own objects, BVH and SoA
+// arrays. Release with animRelease().
+int animPose(const struct Scene *base, int frame, struct Scene *out);
+void animRelease(struct Scene *s);
+
+// animPose() for frames [first, first + n) into out[0, n), one pool task per
+// frame. Returns 0 if any of them failed.
+int animPoseFrames(const struct Scene *base, int first, int n, struct Scene *out, Sched *pool);
+
+#endif
@@ -0,0 +1,18 @@
+# Animated test scene
+s 800,100,1.5708,0.5
+a 40,7
+# Camera moved in, without a target it looks down -z
+c 0.0,0.0,-2.0
+o s,0.9,0.4,0.4,0.0,0.0,-10.0,3.0
+o s,0.9,0.4,0.9,5.0,-2.0,-10.0,2.0
+o p,0.5,0.7,0.5,0.0,-3.5,-5.0,0.0,-1.0,0.0
+l -1.5,2.0,-2.0,150.0
+k 0,0,0.0,0.0,-10.0
+k 0,10,0.0,1.0,-10.0
+k 0,30,0.0,-1.0,-10.0
+k 0,39,0.0,0.0,-10.0
+k 1,0,5.0,-2.0,-10.0
+k 1,20,6.0,-2.0,-12.0
+k 1,39,5.0,-2.0,-10.0
+k l,0,-1.5,2.0,-2.0
+k l,39,1.5,2.0,-2.0
@@ -0,0 +1,307 @@
+#include "bvh.h"
+#include <stdlib.h>
+
+// Number of centroid bins evaluated per axis when looking for a split
+enum { BINS = 16 };
+// Leaves are always split above this size, even when SAH prefers a leaf
+enum { MAX_LEAF = 8 };
+// Past this depth ranges are halved, which keeps traversal stacks bounded
+enum { MEDIAN_DEPTH = 48 };
+
+typedef struct Builder {
+	BvhNode *nodes;
+	int nodesLen;
+	int *prims;
+	Aabb *boxes;
+	Vec3 *centers;
+	int lanes;
+} Builder;
+
+static Aabb emptyBox(void)
+{
+	return (Aabb) {{HUGE_VAL, HUGE_VAL, HUGE_VAL}, {-HUGE_VAL, -HUGE_VAL, -HUGE_VAL}};
+}
+
+static void growBox(Aabb *b, const Aabb *o)
+{
+	b->lo = (Vec3) {BVH_MIN(b->lo.x, o->lo.x), BVH_MIN(b->lo.y, o->lo.y), BVH_MIN(b->lo.z, o->lo.z)};
+	b->hi = (Vec3) {BVH_MAX(b->hi.x, o->hi.x), BVH_MAX(b->hi.y, o->hi.y), BVH_MAX(b->hi.z, o->hi.z)};
+}
+
+static void growPoint(Aabb *b, const Vec3 *p)
+{
+	Aabb pt = {*p, *p};
+	growBox(b, &pt);
+}
+
+static double boxArea(const Aabb *b)
+{
+	double dx = b->hi.x - b->lo.x, dy = b->hi.y - b->lo.y, dz = b->hi.z - b->lo.z;
+
+	if (dx < 0.0 || dy < 0.0 || dz < 0.0)
+		return 0.0;
+
+	return 2.0 * (dx * dy + dy * dz + dz * dx);
+}
+
+static double axisOf(const Vec3 *v, int axis)
+{
+	return (axis == 0) ? v->x : (axis == 1) ? v->y : v->z;
+}
+
+// Leaf cost in kernel calls, a whole SIMD group is tested for the price of one
+static int packs(const Builder *b, int n)
+{
+	return (n + b->lanes - 1) / b->lanes;
+}
+
+static int makeLeaf(Builder *b, int node, int begin, int end)
+{
+	b->nodes[node].first = begin;
+	b->nodes[node].count = (short)(end - begin);
+	return node;
+}
+
+static int buildNode(Builder *b, int begin, int end, int depth)
+{
+	int node = b->nodesLen++;
+	int n = end - begin;
+
+	Aabb box = emptyBox(), cBox = emptyBox();
+	for (int i = begin; i < end; i++)
+	{
+		growBox(&box, &b->boxes[b->prims[i]]);
+		growPoint(&cBox, &b->centers[b->prims[i]]);
+	}
+	b->nodes[node].box = box;
+	b->nodes[node].axis = 0;
+
+	if (n <= 2)
+		return makeLeaf(b, node, begin, end);
+
+	if (depth >= MEDIAN_DEPTH)
+		cBox = emptyBox();
+
+	// Bin centroids along every axis and sweep for the cheapest SAH split
+	double bestCost = HUGE_VAL;
+	int bestAxis = -1, bestBin = 0;
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		double lo = axisOf(&cBox.lo, axis), hi = axisOf(&cBox.hi, axis);
+		if (hi <= lo)
+			continue;
+
+		Aabb bins[BINS];
+		int counts[BINS] = {0};
+		double k = BINS / (hi - lo);
+
+		for (int i = 0; i < BINS; i++)
+			bins[i] = emptyBox();
+
+		for (int i = begin; i < end; i++)
+		{
+			int bin = (int)((axisOf(&b->centers[b->prims[i]], axis) - lo) * k);
+			bin = (bin < BINS) ? bin : BINS - 1;
+			counts[bin]++;
+			growBox(&bins[bin], &b->boxes[b->prims[i]]);
+		}
+
+		double rightArea[BINS];
+		int rightCount[BINS];
+		Aabb acc = emptyBox();
+		int cnt = 0;
+		for (int i = BINS - 1; i > 0; i--)
+		{
+			growBox(&acc, &bins[i]);
+			cnt += counts[i];
+			rightArea[i] = boxArea(&acc);
+			rightCount[i] = cnt;
+		}
+
+		acc = emptyBox();
+		cnt = 0;
+		for (int i = 0; i < BINS - 1; i++)
+		{
+			growBox(&acc, &bins[i]);
+			cnt += counts[i];
+			double cost = boxArea(&acc) * packs(b, cnt) + rightArea[i + 1] * packs(b, rightCount[i + 1]);
+			if (cnt > 0 && rightCount[i + 1] > 0 && cost < bestCost)
+			{
+				bestCost = cost;
+				bestAxis = axis;
+				bestBin = i;
+			}
+		}
+	}
+
+	// Splitting costs one traversal step per child, compare to testing all prims
+	double leafCost = boxArea(&box) * packs(b, n);
+	if (bestAxis < 0 || (n <= MAX_LEAF && bestCost + boxArea(&box) >= leafCost))
+	{
+		if (n <= MAX_LEAF)
+			return makeLeaf(b, node, begin, end);
+
+		// No usable split (or too deep), halve the range so leaves stay small
+		bestAxis = -1;
+	}
+
+	int mid = begin + n / 2;
+	if (bestAxis >= 0)
+	{
+		double lo = axisOf(&cBox.lo, bestAxis), hi = axisOf(&cBox.hi, bestAxis);
+		double k = BINS / (hi - lo);
+		int i = begin, j = end - 1;
+
+		while (i <= j)
+		{
+			int bin = (int)((axisOf(&b->centers[b->prims[i]], bestAxis) - lo) * k);
+			bin = (bin < BINS) ? bin : BINS - 1;
+			if (bin <= bestBin)
+			{
+				i++;
+			}
+			else
+			{
+				int tmp = b->prims[i];
+				b->prims[i] = b->prims[j];
+				b->prims[j--] = tmp;
+			}
+		}
+		mid = i;
+		b->nodes[node].axis = (short)bestAxis;
+	}
+
+	b->nodes[node].count = 0;
+	buildNode(b, begin, mid, depth + 1);
+	b->nodes[node].first = buildNode(b, mid, end, depth + 1);
+
+	return node;
+}
+
+// Builds over bvh->prims and releases the builder's boxes
+static int buildTree(Bvh *bvh, Builder *b)
+{
+	if (bvh->primsLen > 0)
+	{
+		b->nodes = aligned_alloc(64, sizeof(BvhNode) * 2 * bvh->primsLen);
+		if (!b->nodes)
+		{
+			free(b->centers);
+			free(b->boxes);
+			bvhFree(bvh);
+			return 0;
+		}
+
+		b->prims = bvh->prims;
+		buildNode(b, 0, bvh->primsLen, 0);
+	}
+
+	bvh->nodes = b->nodes;
+	bvh->nodesLen = b->nodesLen;
+
+	free(b->centers);
+	free(b->boxes);
+	return 1;
+}
+
+int bvhBuild(Bvh *bvh, Object *objs, int objsLen, int lanes)
+{
+	*bvh = (Bvh) {NULL, 0, NULL, 0, NULL, 0};
+
+	Builder b = {NULL, 0, NULL, NULL, NULL, (lanes > 0) ? lanes : 1};
+	b.boxes = malloc(sizeof(Aabb) * (objsLen + 1));
+	b.centers = malloc(sizeof(Vec3) * (objsLen + 1));
+	bvh->prims = malloc(sizeof(int) * (objsLen + 1));
+	bvh->planes = malloc(sizeof(int) * (objsLen + 1));
+
+	if (!b.boxes || !b.centers || !bvh->prims || !bvh->planes)
+		goto fail;
+
+	// Rounding in hitSphere() can report hits a hair outside the true sphere,
+	// mostly for rays that start far from it. Pad the boxes by a bound on that
+	// error so the tree never rejects a hit the linear scan would accept.
+	double reach = 1.0;
+	for (int i = 0; i < objsLen; i++)
+	{
+		Sphere *s = &objs[i].obj.sp;
+		if (objs[i].type == OBJ_SPHERE)
+			reach = BVH_MAX(reach, mag(&s->o) + fabs(s->r));
+		else if (objs[i].type == OBJ_PLANE)
+			reach = BVH_MAX(reach, mag(&objs[i].obj.pl.o));
+	}
+
+	// Mesh triangles get a tree of their own from bvhBuildTris()
+	for (int i = 0; i < objsLen; i++)
+	{
+		if (objs[i].type == OBJ_PLANE)
+			bvh->planes[bvh->planesLen++] = i;
+		if (objs[i].type != OBJ_SPHERE)
+			continue;
+
+		Sphere *s = &objs[i].obj.sp;
+		double r = fabs(s->r);
+		double pad = r + 2.0 * REAL_EPS * reach * reach / BVH_MAX(r, REAL_TOL * reach) + 1e-3 * REAL_TOL * reach;
+		b.boxes[i] = (Aabb) {{s->o.x - pad, s->o.y - pad, s->o.z - pad},
+							 {s->o.x + pad, s->o.y + pad, s->o.z + pad}};
+		b.centers[i] = s->o;
+		bvh->prims[bvh->primsLen++] = i;
+	}
+
+	return buildTree(bvh, &b);
+
+fail:
+	free(b.centers);
+	free(b.boxes);
+	bvhFree(bvh);
+	return 0;
+}
+
+int bvhBuildTris(Bvh *bvh, const Mesh *mesh, int lanes)
+{
+	int n = mesh->facesLen;
+	*bvh = (Bvh) {NULL, 0, NULL, 0, NULL, 0};
+
+	Builder b = {NULL, 0, NULL, NULL, NULL, (lanes > 0) ? lanes : 1};
+	b.boxes = malloc(sizeof(Aabb) * (n + 1));
+	b.centers = malloc(sizeof(Vec3) * (n + 1));
+	bvh->prims = malloc(sizeof(int) * (n + 1));
+
+	if (!b.boxes || !b.centers || !bvh->prims)
+	{
+		free(b.centers);
+		free(b.boxes);
+		bvhFree(bvh);
+		return 0;
+	}
+
+	// Pad for rounding in the kernel, flat triangles also get some thickness
+	double reach = 1.0;
+	for (int i = 0; i < mesh->vertsLen; i++)
+		reach = BVH_MAX(reach, mag(&mesh->verts[i]));
+	double pad = REAL_TOL * reach;
+
+	for (int i = 0; i < n; i++)
+	{
+		Aabb box = emptyBox();
+		for (int k = 0; k < 3; k++)
+			growPoint(&box, &mesh->verts[mesh->faces[i].v[k]]);
+
+		box.lo = (Vec3) {box.lo.x - pad, box.lo.y - pad, box.lo.z - pad};
+		box.hi = (Vec3) {box.hi.x + pad, box.hi.y + pad, box.hi.z + pad};
+		b.boxes[i] = box;
+		b.centers[i] = (Vec3) {(box.lo.x + box.hi.x) * 0.5, (box.lo.y + box.hi.y) * 0.5, (box.lo.z + box.hi.z) * 0.5};
+		bvh->prims[i] = i;
+	}
+	bvh->primsLen = n;
+
+	return buildTree(bvh, &b);
+}
+
+void bvhFree(Bvh *bvh)
+{
+	free(bvh->nodes);
+	free(bvh->prims);
+	free(bvh->planes);
+	*bvh = (Bvh) {NULL, 0, NULL, 0, NULL, 0};
+}
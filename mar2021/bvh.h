@@ -0,0 +1,60 @@
+#ifndef BVH_H
+#define BVH_H
+#include "obj.h"
+#include "mesh.h"
+
+typedef struct Aabb {
+	Vec3 lo;
+	Vec3 hi;
+} Aabb;
+
+// Nodes are stored depth first: an inner node's left child directly follows
+// it and `first` holds the index of the right child. Leaves have count > 0
+// and cover prims[first, first + count).
+typedef struct BvhNode {
+	Aabb box;
+	int first;
+	short count;
+	short axis;
+} __attribute__((aligned(64))) BvhNode;
+
+// Upper bound on tree depth, sizes traversal stacks
+enum { BVH_STACK = 96 };
+
+typedef struct Bvh {
+	BvhNode *nodes;
+	int nodesLen;
+	// Object indices in leaf order
+	int *prims;
+	int primsLen;
+	// Unbounded objects (planes) that are always tested linearly
+	int *planes;
+	int planesLen;
+} Bvh;
+
+// Builds the hierarchy with binned SAH, lanes is the width of the leaf
+// intersection kernel. Returns 0 on allocation failure.
+int bvhBuild(Bvh *bvh, Object *objs, int objsLen, int lanes);
+
+// Same over the faces of mesh, prims then index mesh->faces
+int bvhBuildTris(Bvh *bvh, const Mesh *mesh, int lanes);
+void bvhFree(Bvh *bvh);
+
+#define BVH_MIN(a, b) ((a) < (b) ? (a) : (b))
+#define BVH_MAX(a, b) ((a) > (b) ? (a) : (b))
+
+// Slab test, returns the entry distance or a negative value on a miss.
+// inv holds 1 / r->d per axis.
+static inline real hitAabb(const Aabb *b, const Ray *r, const Vec3 *inv, real tMax)
+{
+	real tx0 = (b->lo.x - r->o.x) * inv->x, tx1 = (b->hi.x - r->o.x) * inv->x;
+	real ty0 = (b->lo.y - r->o.y) * inv->y, ty1 = (b->hi.y - r->o.y) * inv->y;
+	real tz0 = (b->lo.z - r->o.z) * inv->z, tz1 = (b->hi.z - r->o.z) * inv->z;
+
+	real tNear = BVH_MAX(BVH_MAX(BVH_MIN(tx0, tx1), BVH_MIN(ty0, ty1)), BVH_MAX(BVH_MIN(tz0, tz1), (real)0.0));
+	real tFar = BVH_MIN(BVH_MIN(BVH_MAX(tx0, tx1), BVH_MAX(ty0, ty1)), BVH_MIN(BVH_MAX(tz0, tz1), tMax));
+
+	return (tNear <= tFar) ? tNear : (real)-1.0;
+}
+
+#endif
@@ -0,0 +1,121 @@
+#include "camera.h"
+#include "stats.h"
+#include <stdint.h>
+#include <string.h>
+
+void cameraBuild(Camera *cam, int width, int height, double fov)
+{
+	Vec3 f = sub(&cam->at, &cam->o);
+	Vec3 up = {0.0, 1.0, 0.0};
+
+	f = (dot(&f, &f) > 0.0) ? norm(&f) : (Vec3) {0.0, 0.0, -1.0};
+	// Looking straight up or down, roll so that -z is up
+	if (fabs(f.y) > 1.0 - 1e-9)
+		up = (Vec3) {0.0, 0.0, -1.0};
+
+	Vec3 u = cross(&f, &up);
+	u = norm(&u);
+	Vec3 v = cross(&u, &f);
+
+	cam->fov = fov;
+	cam->width = width;
+	cam->height = height;
+	cam->u = u;
+	cam->v = v;
+	cam->f = f;
+	cam->hy = tan(fov / 2.0);
+	cam->hx = cam->hy * (double)width / (double)height;
+
+	// Pixel (x, y) looks along f + ((x + 0.5) / width * 2 - 1) * hx * u +
+	// (1 - (y + 0.5) / height * 2) * hy * v
+	Vec3 a = scale(&u, cam->hx / (double)width - cam->hx);
+	Vec3 b = scale(&v, cam->hy - cam->hy / (double)height);
+	cam->d00 = add(&f, &a);
+	cam->d00 = add(&cam->d00, &b);
+	cam->dx = scale(&u, 2.0 * cam->hx / (double)width);
+	cam->dy = scale(&v, -2.0 * cam->hy / (double)height);
+}
+
+// 1 / sqrt(a) for a > 0: a guess from the bit pattern, good to about 3%,
+// and Newton steps that each double the correct bits. Only integer and
+// multiply / add steps, so it vectorizes and rounds the same on every
+// machine.
+#ifdef RAYS_FLOAT
+typedef uint32_t Bits;
+#define RSQRT_GUESS 0x5f375a86u
+#define NEWTON_STEPS 3
+#else
+typedef uint64_t Bits;
+#define RSQRT_GUESS 0x5fe6eb50c7b537a9ull
+#define NEWTON_STEPS 4
+#endif
+
+static inline real rsqrt(real a)
+{
+	Bits i;
+	real y;
+
+	memcpy(&i, &a, sizeof(i));
+	i = RSQRT_GUESS - (i >> 1);
+	memcpy(&y, &i, sizeof(y));
+
+	for (int k = 0; k < NEWTON_STEPS; k++)
+		y = y * ((real)1.5 - (real)0.5 * a * y * y);
+
+	return y;
+}
+
+// Pixels per block of the row loop, a fixed count so it vectorizes at -O2
+enum { BLOCK = 8 };
+
+// Cloned per instruction set so the loop vectorizes across pixels
+__attribute__((target_clones("avx512f", "avx2", "default")))
+void cameraRow(const Camera *cam, int x, int y, int n, Ray *out)
+{
+	real dx[CAMERA_ROW + BLOCK], dy[CAMERA_ROW + BLOCK], dz[CAMERA_ROW + BLOCK];
+	// Start of the row once, then one multiply-add per component and pixel
+	real rx = cam->d00.x + (real)y * cam->dy.x;
+	real ry = cam->d00.y + (real)y * cam->dy.y;
+	real rz = cam->d00.z + (real)y * cam->dy.z;
+
+	STATS_ADD(STAT_RAYS, n);
+
+	// The last block runs past n, its extra lanes are never stored
+	for (int b = 0; b < n; b += BLOCK)
+	{
+		for (int i = b; i < b + BLOCK; i++)
+		{
+			real c = (real)(x + i);
+			real px = rx + c * cam->dx.x, py = ry + c * cam->dx.y, pz = rz + c * cam->dx.z;
+			real s = rsqrt(px * px + py * py + pz * pz);
+
+			dx[i] = px * s;
+			dy[i] = py * s;
+			dz[i] = pz * s;
+		}
+	}
+
+	for (int i = 0; i < n; i++)
+		out[i] = (Ray) {cam->o, {dx[i], dy[i], dz[i]}};
+}
+
+Ray cameraRay(const Camera *cam, int x, int y)
+{
+	Ray r;
+	cameraRow(cam, x, y, 1, &r);
+	return r;
+}
+
+int cameraProject(const Camera *cam, Vec3 p, int dir, double *x, double *y)
+{
+	Vec3 q = dir ? p : sub(&p, (Vec3 *)&cam->o);
+	double depth = dot(&q, (Vec3 *)&cam->f);
+
+	if (depth < 1e-9)
+		return 0;
+
+	*x = (dot(&q, (Vec3 *)&cam->u) / depth / cam->hx + 1.0) * 0.5 * (double)cam->width - 0.5;
+	*y = (1.0 - dot(&q, (Vec3 *)&cam->v) / depth / cam->hy) * 0.5 * (double)cam->height - 0.5;
+
+	return 1;
+}
@@ -0,0 +1,36 @@
+#ifndef CAMERA_H
+#define CAMERA_H
+#include "obj.h"
+
+// Pinhole camera at o looking at at, fov is the vertical field of view.
+// Everything below at is derived by cameraBuild().
+typedef struct Camera {
+	Vec3 o, at;
+	double fov;
+	int width, height;
+
+	// Unit basis: right, up and the view direction
+	Vec3 u, v, f;
+	// Half extents of the image plane one unit in front of the eye
+	real hx, hy;
+	// Unnormalised direction through the centre of pixel (0, 0) and the
+	// steps to the next column and row
+	Vec3 d00, dx, dy;
+} Camera;
+
+// Widest row cameraRow() fills in one call
+enum { CAMERA_ROW = 64 };
+
+void cameraBuild(Camera *cam, int width, int height, double fov);
+
+// Rays through pixels [x, x + n) of row y, n <= CAMERA_ROW. Every ray only
+// depends on its own pixel, so any split of a row gives the same rays.
+void cameraRow(const Camera *cam, int x, int y, int n, Ray *out);
+
+Ray cameraRay(const Camera *cam, int x, int y);
+
+// Pixel coordinates of point p, or of the vanishing point of direction p
+// when dir is set. Returns 0 when it is not in front of the camera.
+int cameraProject(const Camera *cam, Vec3 p, int dir, double *x, double *y);
+
+#endif
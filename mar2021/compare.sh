@@ -0,0 +1,38 @@
+#!/bin/sh
+# Renders a scene with rays and rays_f and reports the speedup of the float
+# build and how far its pixels are from the double reference.
+# Usage: ./compare.sh scene.sc [runs] [rays options...]
+scene=$1
+runs=${2:-3}
+[ -n "$scene" ] || { echo "Usage: ./compare.sh scene.sc [runs] [rays options...]"; exit 1; }
+shift; [ $# -gt 0 ] && shift
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+# Best render time over runs, from the -v report
+best()
+{
+	for i in $(seq "$runs"); do
+		"$@" 2>&1 >/dev/null | sed -n 's/^Rendered .* in \([0-9.]*\) ms.*/\1/p'
+	done | sort -n | head -n 1
+}
+
+d=$(best ./rays -v "$@" -d "$tmp/d.raw" "$scene" "$tmp/d.gif")
+f=$(best ./rays_f -v "$@" -d "$tmp/f.raw" "$scene" "$tmp/f.gif")
+[ -n "$d" ] && [ -n "$f" ] || { echo "Rendering '$scene' failed"; exit 1; }
+pixels=$(wc -c < "$tmp/d.raw")
+
+# Palette index i >= 16 is the colour cube level ((i-16)/36, (i-16)/6%6, (i-16)%6),
+# the 16 system colours are only used for black. Errors are in cube levels.
+cmp -l "$tmp/d.raw" "$tmp/f.raw" | awk -v d="$d" -v f="$f" -v n="$pixels" '
+function oct(s, v, k) { v = 0; for (k = 1; k <= length(s); k++) v = v * 8 + substr(s, k, 1); return v }
+function lv(i, c) { i = (i < 16) ? 0 : i - 16; return (c == 0) ? int(i / 36) : (c == 1) ? int(i / 6) % 6 : i % 6 }
+{
+	a = oct($2); b = oct($3)
+	for (c = 0; c < 3; c++) { e = lv(a, c) - lv(b, c); e = (e < 0) ? -e : e; sum += e; if (e > max) max = e }
+	diff++
+}
+END {
+	printf "double %.2f ms, float %.2f ms, %.2fx\n", d, f, d / f
+	printf "%d of %d pixels differ (%.4f%%), mean error %.5f levels, max %d\n", diff, n, 100 * diff / n, sum / (3 * n), max
+}'
@@ -1,4 +1,6 @@
 #include "gifenc.h"
+#include "stats.h"
+#include "trace.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,14 +8,23 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <errno.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #ifdef _WIN32
 #include <io.h>
 #else
 #include <unistd.h>
+#include <sys/uio.h>
 #endif
 
 /* helper to write a little-endian 16-bit number portably */
-#define write_num(fd, n) write((fd), (uint8_t []) {(n) & 0xFF, (n) >> 8}, 2)
+#define put_num(gif, n) put_bytes((gif), (uint8_t []) {(n) & 0xFF, (n) >> 8}, 2)
+
+/* default size of the output buffer in front of the file descriptor */
+#define OUT_SIZE 0x10000
 
 static uint8_t vga[0x30] = {
     0x00, 0x00, 0x00,
@@ -34,48 +45,138 @@ static uint8_t vga[0x30] = {
     0xFF, 0xFF, 0xFF,
 };
 
-struct Node {
-    uint16_t key;
-    struct Node *children[];
+/* LZW dictionary: open-addressing hash table mapping (prefix code, pixel)
+ * to code. Entries are tagged with a generation, so clearing it is just
+ * bumping the generation. */
+#define DICT_BITS 13
+#define DICT_SIZE (1 << DICT_BITS)
+
+typedef struct Entry {
+    uint32_t key;
+    uint16_t code;
+    uint16_t gen;
+} Entry;
+
+typedef struct ge_Dict Dict;
+struct ge_Dict {
+    uint16_t gen;
+    Entry entries[DICT_SIZE];
 };
-typedef struct Node Node;
 
-static Node *
-new_node(uint16_t key, int degree)
+static void
+dict_reset(Dict *dict)
+{
+    if (++dict->gen == 0) {
+        /* generation wrapped around; old tags could look current */
+        memset(dict->entries, 0, sizeof(dict->entries));
+        dict->gen = 1;
+    }
+}
+
+/* Returns the slot for key: either its entry or the empty slot to fill. */
+static Entry *
+dict_find(Dict *dict, uint32_t key)
 {
-    Node *node = calloc(1, sizeof(*node) + degree * sizeof(Node *));
-    if (node)
-        node->key = key;
-    return node;
+    uint32_t i = (key * 2654435761u) >> (32 - DICT_BITS);
+    for (;;) {
+        Entry *e = &dict->entries[i];
+        if (e->gen != dict->gen || e->key == key)
+            return e;
+        i = (i + 1) & (DICT_SIZE - 1);
+    }
 }
 
-static Node *
-new_trie(int degree, int *nkeys)
+/* Write the buffered bytes plus n more from data straight to the file,
+ * in one writev() call when the system allows. */
+static void
+flush_out(ge_GIF *gif, const uint8_t *data, size_t n)
 {
-    Node *root = new_node(0, degree);
-    /* Create nodes for single pixels. */
-    for (*nkeys = 0; *nkeys < degree; (*nkeys)++)
-        root->children[*nkeys] = new_node(*nkeys, degree);
-    *nkeys += 2; /* skip clear code and stop code */
-    return root;
+    STATS_BEGIN(io);
+    TRACE_BEGIN(start);
+#ifdef _WIN32
+    if (gif->outlen)
+        write(gif->fd, gif->out, gif->outlen);
+    if (n)
+        write(gif->fd, data, n);
+#else
+    struct iovec iov[2] = {
+        {gif->out, gif->outlen},
+        {(void *) data, n},
+    };
+    struct iovec *v = iov;
+    int cnt = 2;
+    ssize_t done;
+
+    while (cnt) {
+        if (!v->iov_len) {
+            v++; cnt--;
+            continue;
+        }
+        done = writev(gif->fd, v, cnt);
+        if (done < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        while (cnt && (size_t) done >= v->iov_len) {
+            done -= v->iov_len;
+            v++; cnt--;
+        }
+        if (cnt) {
+            v->iov_base = (uint8_t *) v->iov_base + done;
+            v->iov_len -= done;
+        }
+    }
+#endif
+    TRACE_END(start, "write", "bytes", (int64_t) (gif->outlen + n));
+    gif->outlen = 0;
+    STATS_END(PHASE_IO, io);
 }
 
 static void
-del_trie(Node *root, int degree)
+put_bytes(ge_GIF *gif, const void *data, size_t n)
 {
-    if (!root)
+    if (gif->mem) {
+        /* memory mode: keep counting past the end so the caller learns
+         * how big the buffer needed to be */
+        if (gif->memcap > *gif->memlen)
+            memcpy(&gif->mem[*gif->memlen], data,
+                   gif->memcap - *gif->memlen < n ? gif->memcap - *gif->memlen : n);
+        *gif->memlen += n;
         return;
-    for (int i = 0; i < degree; i++)
-        del_trie(root->children[i], degree);
-    free(root);
+    }
+    if (gif->outlen + n > gif->outcap) {
+        if (n >= gif->outcap) {
+            flush_out(gif, data, n);
+            return;
+        }
+        flush_out(gif, NULL, 0);
+    }
+    memcpy(&gif->out[gif->outlen], data, n);
+    gif->outlen += n;
+}
+
+void
+ge_set_buffer(ge_GIF *gif, size_t size)
+{
+    uint8_t *out;
+
+    if (gif->mem)
+        return;
+    flush_out(gif, NULL, 0);
+    out = realloc(gif->out, size ? size : 1);
+    if (!out)
+        return;
+    gif->out = out;
+    gif->outcap = size;
 }
 
 static void put_loop(ge_GIF *gif, uint16_t loop);
 
-ge_GIF *
-ge_new_gif(
-    const char *fname, uint16_t width, uint16_t height,
-    uint8_t *palette, int depth, int loop
+static ge_GIF *
+new_gif(
+    int fd, uint8_t *mem, size_t memcap, size_t *memlen,
+    uint16_t width, uint16_t height, uint8_t *palette, int depth, int loop
 )
 {
     int i, r, g, b, v;
@@ -86,31 +187,36 @@ ge_new_gif(
     gif->depth = depth > 1 ? depth : 2;
     gif->frame = (uint8_t *) &gif[1];
     gif->back = &gif->frame[width*height];
-#ifdef _WIN32
-    gif->fd = creat(fname, S_IWRITE);
-#else
-    gif->fd = creat(fname, 0666);
-#endif
-    if (gif->fd == -1)
-        goto no_fd;
-#ifdef _WIN32
-    setmode(gif->fd, O_BINARY);
-#endif
-    write(gif->fd, "GIF89a", 6);
-    write_num(gif->fd, width);
-    write_num(gif->fd, height);
-    write(gif->fd, (uint8_t []) {0xF0 | (depth-1), 0x00, 0x00}, 3);
+    gif->dict = calloc(1, sizeof(*gif->dict));
+    if (!gif->dict)
+        goto no_dict;
+    gif->fd = fd;
+    gif->mem = mem;
+    gif->memcap = memcap;
+    gif->memlen = memlen;
+    if (mem) {
+        *memlen = 0;
+    } else {
+        gif->out = malloc(OUT_SIZE);
+        if (!gif->out)
+            goto no_out;
+        gif->outcap = OUT_SIZE;
+    }
+    put_bytes(gif, "GIF89a", 6);
+    put_num(gif, width);
+    put_num(gif, height);
+    put_bytes(gif, (uint8_t []) {0xF0 | (depth-1), 0x00, 0x00}, 3);
     if (palette) {
-        write(gif->fd, palette, 3 << depth);
+        put_bytes(gif, palette, 3 << depth);
     } else if (depth <= 4) {
-        write(gif->fd, vga, 3 << depth);
+        put_bytes(gif, vga, 3 << depth);
     } else {
-        write(gif->fd, vga, sizeof(vga));
+        put_bytes(gif, vga, sizeof(vga));
         i = 0x10;
         for (r = 0; r < 6; r++) {
             for (g = 0; g < 6; g++) {
                 for (b = 0; b < 6; b++) {
-                    write(gif->fd, (uint8_t []) {r*51, g*51, b*51}, 3);
+                    put_bytes(gif, (uint8_t []) {r*51, g*51, b*51}, 3);
                     if (++i == 1 << depth)
                         goto done_gct;
                 }
@@ -118,144 +224,483 @@ ge_new_gif(
         }
         for (i = 1; i <= 24; i++) {
             v = i * 0xFF / 25;
-            write(gif->fd, (uint8_t []) {v, v, v}, 3);
+            put_bytes(gif, (uint8_t []) {v, v, v}, 3);
         }
     }
 done_gct:
     if (loop >= 0 && loop <= 0xFFFF)
         put_loop(gif, (uint16_t) loop);
     return gif;
-no_fd:
+no_out:
+    free(gif->dict);
+no_dict:
     free(gif);
 no_gif:
     return NULL;
 }
 
+ge_GIF *
+ge_new_gif(
+    const char *fname, uint16_t width, uint16_t height,
+    uint8_t *palette, int depth, int loop
+)
+{
+    ge_GIF *gif;
+    int fd;
+#ifdef _WIN32
+    fd = creat(fname, S_IWRITE);
+#else
+    fd = creat(fname, 0666);
+#endif
+    if (fd == -1)
+        return NULL;
+#ifdef _WIN32
+    setmode(fd, O_BINARY);
+#endif
+    gif = new_gif(fd, NULL, 0, NULL, width, height, palette, depth, loop);
+    if (!gif)
+        close(fd);
+    return gif;
+}
+
+ge_GIF *
+ge_new_gif_mem(
+    uint8_t *buf, size_t size, size_t *len, uint16_t width, uint16_t height,
+    uint8_t *palette, int depth, int loop
+)
+{
+    return new_gif(-1, buf, size, len, width, height, palette, depth, loop);
+}
+
 static void
 put_loop(ge_GIF *gif, uint16_t loop)
 {
-    write(gif->fd, (uint8_t []) {'!', 0xFF, 0x0B}, 3);
-    write(gif->fd, "NETSCAPE2.0", 11);
-    write(gif->fd, (uint8_t []) {0x03, 0x01}, 2);
-    write_num(gif->fd, loop);
-    write(gif->fd, "\0", 1);
+    put_bytes(gif, (uint8_t []) {'!', 0xFF, 0x0B}, 3);
+    put_bytes(gif, "NETSCAPE2.0", 11);
+    put_bytes(gif, (uint8_t []) {0x03, 0x01}, 2);
+    put_num(gif, loop);
+    put_bytes(gif, "\0", 1);
 }
 
-/* Add packed key to buffer, updating offset and partial.
- *   gif->offset holds position to put next *bit*
- *   gif->partial holds bits to include in next byte */
 static void
-put_key(ge_GIF *gif, uint16_t key, int key_size)
+set_delay(ge_GIF *gif, uint16_t d)
 {
-    int byte_offset, bit_offset, bits_to_write;
-    byte_offset = gif->offset / 8;
-    bit_offset = gif->offset % 8;
-    gif->partial |= ((uint32_t) key) << bit_offset;
-    bits_to_write = bit_offset + key_size;
-    while (bits_to_write >= 8) {
-        gif->buffer[byte_offset++] = gif->partial & 0xFF;
-        if (byte_offset == 0xFF) {
-            write(gif->fd, "\xFF", 1);
-            write(gif->fd, gif->buffer, 0xFF);
-            byte_offset = 0;
-        }
-        gif->partial >>= 8;
-        bits_to_write -= 8;
-    }
-    gif->offset = (gif->offset + key_size) % (0xFF * 8);
+    put_bytes(gif, (uint8_t []) {'!', 0xF9, 0x04, 0x04}, 4);
+    put_num(gif, d);
+    put_bytes(gif, "\0\0", 2);
 }
 
+/* Growable bit string holding one strip of packed LZW codes. */
+typedef struct Bits {
+    uint8_t *data;
+    size_t len; /* in bits */
+    size_t cap; /* in bytes */
+} Bits;
+
+/* Append key to the bit string, least significant bit first. */
 static void
-end_key(ge_GIF *gif)
+put_key(Bits *bits, uint16_t key, int key_size)
 {
-    int byte_offset;
-    byte_offset = gif->offset / 8;
-    if (gif->offset % 8)
-        gif->buffer[byte_offset++] = gif->partial & 0xFF;
-    write(gif->fd, (uint8_t []) {byte_offset}, 1);
-    write(gif->fd, gif->buffer, byte_offset);
-    write(gif->fd, "\0", 1);
-    gif->offset = gif->partial = 0;
+    size_t byte_offset = bits->len / 8;
+    int bit_offset = bits->len % 8;
+    uint32_t partial;
+    if (byte_offset + 4 > bits->cap) {
+        size_t cap = bits->cap ? bits->cap * 2 : 0x1000;
+        bits->data = realloc(bits->data, cap);
+        memset(&bits->data[bits->cap], 0, cap - bits->cap);
+        bits->cap = cap;
+    }
+    partial = ((uint32_t) key) << bit_offset;
+    bits->data[byte_offset++] |= partial & 0xFF;
+    bits->data[byte_offset++] |= (partial >> 8) & 0xFF;
+    bits->data[byte_offset] |= (partial >> 16) & 0xFF;
+    bits->len += key_size;
 }
 
+/* LZW-compress n pixels into bits. A frame may be split into strips that
+ * are compressed independently: only the first strip starts with a clear
+ * code, every other strip's dictionary is reset by the clear code that ends
+ * the strip before it, and the last strip ends with the stop code. */
 static void
-put_image(ge_GIF *gif, uint16_t w, uint16_t h, uint16_t x, uint16_t y)
+put_strip(Bits *bits, Dict *dict, const uint8_t *pixels, size_t n, int depth,
+          int first, int last)
 {
-    int nkeys, key_size, i, j;
-    Node *node, *child, *root;
-    int degree = 1 << gif->depth;
-
-    write(gif->fd, ",", 1);
-    write_num(gif->fd, x);
-    write_num(gif->fd, y);
-    write_num(gif->fd, w);
-    write_num(gif->fd, h);
-    write(gif->fd, (uint8_t []) {0x00, gif->depth}, 2);
-    root = node = new_trie(degree, &nkeys);
-    key_size = gif->depth + 1;
-    put_key(gif, degree, key_size); /* clear code */
-    for (i = y; i < y+h; i++) {
-        for (j = x; j < x+w; j++) {
-            uint8_t pixel = gif->frame[i*gif->w+j] & (degree - 1);
-            child = node->children[pixel];
-            if (child) {
-                node = child;
+    int nkeys, key_size;
+    size_t i;
+    uint16_t code;
+    int degree = 1 << depth;
+
+    dict_reset(dict);
+    nkeys = degree + 2; /* skip clear code and stop code */
+    key_size = depth + 1;
+    if (first)
+        put_key(bits, degree, key_size); /* clear code */
+    if (!n) {
+        /* Empty frame: nothing to read from pixels */
+        put_key(bits, degree + !!last, key_size);
+        return;
+    }
+    code = pixels[0] & (degree - 1);
+    for (i = 1; i < n; i++) {
+        uint8_t pixel = pixels[i] & (degree - 1);
+        Entry *e = dict_find(dict, (uint32_t) code << 8 | pixel);
+        if (e->gen == dict->gen) {
+            code = e->code;
+        } else {
+            put_key(bits, code, key_size);
+            if (nkeys < 0x1000) {
+                if (nkeys == (1 << key_size))
+                    key_size++;
+                e->key = (uint32_t) code << 8 | pixel;
+                e->code = nkeys++;
+                e->gen = dict->gen;
             } else {
-                put_key(gif, node->key, key_size);
-                if (nkeys < 0x1000) {
-                    if (nkeys == (1 << key_size))
-                        key_size++;
-                    node->children[pixel] = new_node(nkeys++, degree);
-                } else {
-                    put_key(gif, degree, key_size); /* clear code */
-                    del_trie(root, degree);
-                    root = node = new_trie(degree, &nkeys);
-                    key_size = gif->depth + 1;
+                put_key(bits, degree, key_size); /* clear code */
+                dict_reset(dict);
+                nkeys = degree + 2;
+                key_size = depth + 1;
+            }
+            code = pixel;
+        }
+    }
+    put_key(bits, code, key_size);
+    /* The decoder adds a dictionary entry for the code just written, and
+     * widens its codes when that fills the current size. */
+    if (nkeys == (1 << key_size) && key_size < 12)
+        key_size++;
+    put_key(bits, degree + !!last, key_size); /* stop code or clear code */
+}
+
+/* Frame waiting to be compressed and written. */
+typedef struct Job {
+    uint8_t *pixels;
+    uint16_t w, h, x, y, delay;
+    int nstrips, pending;
+    int seq;
+    Bits *strips;
+} Job;
+
+/* Work queue entry: one strip of one job. */
+typedef struct Task {
+    Job *job;
+    int strip;
+} Task;
+
+struct ge_Pipe {
+    pthread_t *threads;
+    int nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t work, room;
+    Task *tasks;
+    int head, ntasks, maxtasks;
+    Job **ready;     /* finished jobs by sequence number, modulo window */
+    int window;      /* frames allowed in flight */
+    int next_seq, write_seq, inflight;
+    int writing, quit;
+};
+
+/* Pixels per strip when frames are compressed in parallel. */
+#define STRIP_SIZE 0x40000
+
+static void
+put_job(ge_GIF *gif, Job *job)
+{
+    uint8_t block[0x100];
+    uint32_t acc = 0;
+    int nacc = 0, nblock = 0;
+    int i;
+    size_t j;
+
+    if (job->delay)
+        set_delay(gif, job->delay);
+    put_bytes(gif, ",", 1);
+    put_num(gif, job->x);
+    put_num(gif, job->y);
+    put_num(gif, job->w);
+    put_num(gif, job->h);
+    put_bytes(gif, (uint8_t []) {0x00, gif->depth}, 2);
+    /* Concatenate the strips bit by bit and cut into 255-byte sub-blocks. */
+    for (i = 0; i < job->nstrips; i++) {
+        Bits *bits = &job->strips[i];
+        for (j = 0; j < bits->len; j += 8) {
+            int n = bits->len - j < 8 ? bits->len - j : 8;
+            acc |= (uint32_t) (bits->data[j / 8] & ((1 << n) - 1)) << nacc;
+            nacc += n;
+            if (nacc >= 8) {
+                block[1 + nblock++] = acc & 0xFF;
+                acc >>= 8;
+                nacc -= 8;
+                if (nblock == 0xFF) {
+                    block[0] = 0xFF;
+                    put_bytes(gif, block, 0x100);
+                    nblock = 0;
                 }
-                node = root->children[pixel];
             }
         }
     }
-    put_key(gif, node->key, key_size);
-    put_key(gif, degree + 1, key_size); /* stop code */
-    end_key(gif);
-    del_trie(root, degree);
+    if (nacc)
+        block[1 + nblock++] = acc & 0xFF;
+    block[0] = nblock;
+    put_bytes(gif, block, nblock + 1);
+    put_bytes(gif, "\0", 1);
+}
+
+static void
+del_job(Job *job)
+{
+    int i;
+    for (i = 0; i < job->nstrips; i++)
+        free(job->strips[i].data);
+    free(job->strips);
+    free(job->pixels);
+    free(job);
+}
+
+static void
+run_task(Task *task, Dict *dict, int depth)
+{
+    Job *job = task->job;
+    size_t n = (size_t) job->w * job->h;
+    size_t first = (size_t) task->strip * STRIP_SIZE;
+    int last = task->strip == job->nstrips - 1;
+    STATS_BEGIN(lzw);
+    TRACE_BEGIN(start);
+    put_strip(&job->strips[task->strip], dict, &job->pixels[first],
+              last ? n - first : STRIP_SIZE, depth, task->strip == 0, last);
+    TRACE_END(start, "lzw", "strip", task->strip);
+    STATS_END(PHASE_LZW, lzw);
 }
 
+static void *
+pipe_main(void *arg)
+{
+    ge_GIF *gif = arg;
+    ge_Pipe *pipe = gif->pipe;
+    Dict *dict = calloc(1, sizeof(*dict));
+    Task task;
+    Job *job;
+
+    traceName("encoder", -1);
+    pthread_mutex_lock(&pipe->lock);
+    for (;;) {
+        while (!pipe->ntasks && !pipe->quit)
+            pthread_cond_wait(&pipe->work, &pipe->lock);
+        if (!pipe->ntasks)
+            break;
+        task = pipe->tasks[pipe->head];
+        pipe->head = (pipe->head + 1) % pipe->maxtasks;
+        pipe->ntasks--;
+        pthread_mutex_unlock(&pipe->lock);
+
+        run_task(&task, dict, gif->depth);
+
+        pthread_mutex_lock(&pipe->lock);
+        if (--task.job->pending)
+            continue;
+        /* Frame complete; whoever finds the next frame in order writes it
+         * and any that were waiting behind it. */
+        pipe->ready[task.job->seq % pipe->window] = task.job;
+        while (!pipe->writing && (job = pipe->ready[pipe->write_seq % pipe->window])) {
+            pipe->ready[pipe->write_seq % pipe->window] = NULL;
+            pipe->writing = 1;
+            pthread_mutex_unlock(&pipe->lock);
+            TRACE_BEGIN(start);
+            put_job(gif, job);
+            TRACE_END(start, "put frame", "frame", (int64_t) job->seq);
+            del_job(job);
+            pthread_mutex_lock(&pipe->lock);
+            pipe->writing = 0;
+            pipe->write_seq++;
+            pipe->inflight--;
+            pthread_cond_broadcast(&pipe->room);
+        }
+    }
+    pthread_mutex_unlock(&pipe->lock);
+    free(dict);
+    return NULL;
+}
+
+/* Index of the first byte where a and b differ in [0, n), n if none. */
 static int
-get_bbox(ge_GIF *gif, uint16_t *w, uint16_t *h, uint16_t *x, uint16_t *y)
+first_diff(const uint8_t *a, const uint8_t *b, int n)
 {
-    int i, j, k;
-    int left, right, top, bottom;
-    left = gif->w; right = 0;
-    top = gif->h; bottom = 0;
-    k = 0;
-    for (i = 0; i < gif->h; i++) {
-        for (j = 0; j < gif->w; j++, k++) {
-            if (gif->frame[k] != gif->back[k]) {
-                if (j < left)   left    = j;
-                if (j > right)  right   = j;
-                if (i < top)    top     = i;
-                if (i > bottom) bottom  = i;
+    int i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *) &a[i]);
+        __m128i vb = _mm_loadu_si128((const __m128i *) &b[i]);
+        int ne = ~_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) & 0xFFFF;
+        if (ne)
+            return i + __builtin_ctz(ne);
+    }
+#endif
+    for (; i < n; i++)
+        if (a[i] != b[i])
+            return i;
+    return n;
+}
+
+/* Index of the last byte where a and b differ in [0, n), -1 if none. */
+static int
+last_diff(const uint8_t *a, const uint8_t *b, int n)
+{
+    int i = n;
+#ifdef __SSE2__
+    for (; i >= 16; i -= 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *) &a[i - 16]);
+        __m128i vb = _mm_loadu_si128((const __m128i *) &b[i - 16]);
+        int ne = ~_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) & 0xFFFF;
+        if (ne)
+            return i - 16 + 31 - __builtin_clz(ne);
+    }
+#endif
+    while (i--)
+        if (a[i] != b[i])
+            return i;
+    return -1;
+}
+
+/* Limit the search to the bounding box of the dirty tiles, if any. */
+static int
+dirty_bbox(ge_GIF *gif, int *x0, int *y0, int *x1, int *y1)
+{
+    int cols = (gif->w + gif->tile - 1) / gif->tile;
+    int rows = (gif->h + gif->tile - 1) / gif->tile;
+    int i, j, any = 0;
+    int l = cols, r = -1, t = rows, b = -1;
+
+    for (i = 0; i < rows; i++) {
+        const uint8_t *row = &gif->dirty[i * cols];
+        for (j = 0; j < cols; j++) {
+            if (row[j]) {
+                if (j < l) l = j;
+                if (j > r) r = j;
+                if (i < t) t = i;
+                b = i;
+                any = 1;
             }
         }
     }
-    if (left != gif->w && top != gif->h) {
-        *x = left; *y = top;
-        *w = right - left + 1;
-        *h = bottom - top + 1;
-        return 1;
-    } else {
+    if (!any)
         return 0;
+    *x0 = l * gif->tile; *x1 = (r + 1) * gif->tile;
+    *y0 = t * gif->tile; *y1 = (b + 1) * gif->tile;
+    if (*x1 > gif->w) *x1 = gif->w;
+    if (*y1 > gif->h) *y1 = gif->h;
+    return 1;
+}
+
+static int
+get_bbox(ge_GIF *gif, uint16_t *w, uint16_t *h, uint16_t *x, uint16_t *y)
+{
+    int i, n;
+    int x0 = 0, y0 = 0, x1 = gif->w, y1 = gif->h;
+    int left, right, top, bottom;
+    const uint8_t *a, *b;
+
+    if (gif->dirty && !dirty_bbox(gif, &x0, &y0, &x1, &y1))
+        return 0;
+    n = x1 - x0;
+    a = &gif->frame[y0 * gif->w + x0];
+    b = &gif->back[y0 * gif->w + x0];
+
+    /* first and last differing rows, whole rows at a time */
+    for (top = y0; top < y1; top++, a += gif->w, b += gif->w)
+        if (first_diff(a, b, n) < n)
+            break;
+    if (top == y1)
+        return 0;
+    for (bottom = y1 - 1; bottom > top; bottom--) {
+        i = bottom * gif->w + x0;
+        if (last_diff(&gif->frame[i], &gif->back[i], n) >= 0)
+            break;
     }
+
+    /* then columns: each row only needs checking outside [left, right] */
+    left = n; right = -1;
+    for (i = top; i <= bottom; i++, a += gif->w, b += gif->w) {
+        int l = first_diff(a, b, left);
+        int r = last_diff(&a[right + 1], &b[right + 1], n - right - 1);
+        if (l < left) left = l;
+        if (r >= 0) right += r + 1;
+    }
+    *x = x0 + left; *y = top;
+    *w = right - left + 1;
+    *h = bottom - top + 1;
+    return 1;
 }
 
+/* Enlarge the task ring to hold at least n entries, keeping queue order. */
 static void
-set_delay(ge_GIF *gif, uint16_t d)
+grow_tasks(ge_Pipe *pipe, int n)
+{
+    Task *tasks = malloc(2 * n * sizeof(*tasks));
+    int i;
+    for (i = 0; i < pipe->ntasks; i++)
+        tasks[i] = pipe->tasks[(pipe->head + i) % pipe->maxtasks];
+    free(pipe->tasks);
+    pipe->tasks = tasks;
+    pipe->head = 0;
+    pipe->maxtasks = 2 * n;
+}
+
+void
+ge_set_threads(ge_GIF *gif, int threads)
+{
+    ge_Pipe *pipe;
+    int i;
+
+    if (threads < 2 || gif->pipe)
+        return;
+    /* Out of memory or threads leaves the encoder serial, or with fewer
+     * threads than asked for. */
+    pipe = calloc(1, sizeof(*pipe));
+    if (!pipe)
+        return;
+    pipe->window = 2 * threads;
+    pipe->maxtasks = pipe->window * 64;
+    pipe->tasks = malloc(pipe->maxtasks * sizeof(*pipe->tasks));
+    pipe->ready = calloc(pipe->window, sizeof(*pipe->ready));
+    pipe->threads = malloc(threads * sizeof(*pipe->threads));
+    if (!pipe->tasks || !pipe->ready || !pipe->threads)
+        goto fail;
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->work, NULL);
+    pthread_cond_init(&pipe->room, NULL);
+    gif->pipe = pipe;
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&pipe->threads[i], NULL, pipe_main, gif))
+            break;
+        pipe->nthreads++;
+    }
+    if (pipe->nthreads)
+        return;
+    gif->pipe = NULL;
+    pthread_cond_destroy(&pipe->room);
+    pthread_cond_destroy(&pipe->work);
+    pthread_mutex_destroy(&pipe->lock);
+fail:
+    free(pipe->threads);
+    free(pipe->ready);
+    free(pipe->tasks);
+    free(pipe);
+}
+
+void
+ge_set_tiles(ge_GIF *gif, int tile)
 {
-    write(gif->fd, (uint8_t []) {'!', 0xF9, 0x04, 0x04}, 4);
-    write_num(gif->fd, d);
-    write(gif->fd, "\0\0", 2);
+    int cols, rows;
+
+    free(gif->dirty);
+    gif->dirty = NULL;
+    gif->tile = 0;
+    if (tile <= 0)
+        return;
+    cols = (gif->w + tile - 1) / tile;
+    rows = (gif->h + tile - 1) / tile;
+    gif->dirty = calloc((size_t) cols * rows, 1);
+    if (gif->dirty)
+        gif->tile = tile;
 }
 
 void
@@ -263,9 +708,11 @@ ge_add_frame(ge_GIF *gif, uint16_t delay)
 {
     uint16_t w, h, x, y;
     uint8_t *tmp;
+    ge_Pipe *pipe = gif->pipe;
+    Job *job;
+    size_t n;
+    int i;
 
-    if (delay)
-        set_delay(gif, delay);
     if (gif->nframes == 0) {
         w = gif->w;
         h = gif->h;
@@ -275,17 +722,88 @@ ge_add_frame(ge_GIF *gif, uint16_t delay)
         w = h = 1;
         x = y = 0;
     }
-    put_image(gif, w, h, x, y);
+    if (gif->dirty)
+        memset(gif->dirty, 0, (size_t) ((gif->w + gif->tile - 1) / gif->tile)
+                              * ((gif->h + gif->tile - 1) / gif->tile));
+    job = calloc(1, sizeof(*job));
+    job->w = w; job->h = h;
+    job->x = x; job->y = y;
+    job->delay = delay;
+    n = (size_t) w * h;
+    job->pixels = malloc(n);
+    for (i = 0; i < h; i++)
+        memcpy(&job->pixels[(size_t) i * w], &gif->frame[(y + i) * gif->w + x], w);
+    /* An empty frame still needs one strip, or its job never completes. */
+    job->nstrips = (pipe && n) ? (n + STRIP_SIZE - 1) / STRIP_SIZE : 1;
+    job->pending = job->nstrips;
+    job->strips = calloc(job->nstrips, sizeof(*job->strips));
     gif->nframes++;
     tmp = gif->back;
     gif->back = gif->frame;
     gif->frame = tmp;
+
+    if (!pipe) {
+        Task task = {job, 0};
+        run_task(&task, gif->dict, gif->depth);
+        put_job(gif, job);
+        del_job(job);
+        return;
+    }
+
+    /* Hand the strips to the encoder threads; block while the window of
+     * frames in flight is full. */
+    TRACE_BEGIN(start);
+    pthread_mutex_lock(&pipe->lock);
+    while (pipe->inflight == pipe->window)
+        pthread_cond_wait(&pipe->room, &pipe->lock);
+    TRACE_END(start, "wait window", "inflight", pipe->inflight);
+    if (pipe->ntasks + job->nstrips > pipe->maxtasks)
+        grow_tasks(pipe, pipe->ntasks + job->nstrips);
+    pipe->inflight++;
+    job->seq = pipe->next_seq++;
+    for (i = 0; i < job->nstrips; i++) {
+        Task *task = &pipe->tasks[(pipe->head + pipe->ntasks++) % pipe->maxtasks];
+        task->job = job;
+        task->strip = i;
+    }
+    pthread_cond_broadcast(&pipe->work);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+static void
+del_pipe(ge_Pipe *pipe)
+{
+    int i;
+
+    pthread_mutex_lock(&pipe->lock);
+    while (pipe->inflight)
+        pthread_cond_wait(&pipe->room, &pipe->lock);
+    pipe->quit = 1;
+    pthread_cond_broadcast(&pipe->work);
+    pthread_mutex_unlock(&pipe->lock);
+    for (i = 0; i < pipe->nthreads; i++)
+        pthread_join(pipe->threads[i], NULL);
+    pthread_cond_destroy(&pipe->room);
+    pthread_cond_destroy(&pipe->work);
+    pthread_mutex_destroy(&pipe->lock);
+    free(pipe->threads);
+    free(pipe->ready);
+    free(pipe->tasks);
+    free(pipe);
 }
 
 void
 ge_close_gif(ge_GIF* gif)
 {
-    write(gif->fd, ";", 1);
-    close(gif->fd);
+    if (gif->pipe)
+        del_pipe(gif->pipe);
+    put_bytes(gif, ";", 1);
+    if (!gif->mem) {
+        flush_out(gif, NULL, 0);
+        close(gif->fd);
+    }
+    free(gif->out);
+    free(gif->dirty);
+    free(gif->dict);
     free(gif);
 }
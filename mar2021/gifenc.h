@@ -1,27 +1,54 @@
 #ifndef GIFENC_H
 #define GIFENC_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+typedef struct ge_Pipe ge_Pipe;
+typedef struct ge_Dict ge_Dict;
+
 typedef struct ge_GIF {
     uint16_t w, h;
     int depth;
     int fd;
-    int offset;
     int nframes;
     uint8_t *frame, *back;
-    uint32_t partial;
-    uint8_t buffer[0xFF];
+    ge_Dict *dict;
+    ge_Pipe *pipe;
+    uint8_t *out;
+    size_t outlen, outcap;
+    uint8_t *mem;
+    size_t memcap, *memlen;
+    uint8_t *dirty;
+    int tile;
 } ge_GIF;
 
 ge_GIF *ge_new_gif(
     const char *fname, uint16_t width, uint16_t height,
     uint8_t *palette, int depth, int loop
 );
+/* Compress frames on this many background threads; ge_add_frame() then
+ * returns once the frame is copied and frames are written in order. Large
+ * frames are also split into independently compressed strips. */
+void ge_set_threads(ge_GIF *gif, int threads);
+/* Same as ge_new_gif() but writes into buf (size bytes) instead of a file.
+ * *len tracks the GIF's total size and keeps counting if it outgrows buf. */
+ge_GIF *ge_new_gif_mem(
+    uint8_t *buf, size_t size, size_t *len, uint16_t width, uint16_t height,
+    uint8_t *palette, int depth, int loop
+);
+/* Resize the output buffer; everything is written to the file with writev()
+ * only when the buffer fills up and at ge_close_gif(). */
+void ge_set_buffer(ge_GIF *gif, size_t size);
+/* Track changes in tile x tile blocks. Before each ge_add_frame(), set
+ * gif->dirty[col + row * cols] for every block that may differ from the
+ * previous frame; the changed rectangle is then only searched for inside
+ * those blocks. The mask is cleared after every frame, tile 0 turns it off. */
+void ge_set_tiles(ge_GIF *gif, int tile);
 void ge_add_frame(ge_GIF *gif, uint16_t delay);
 void ge_close_gif(ge_GIF* gif);
 
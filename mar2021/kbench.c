@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "kernel.h"
+
+// Times the leaf intersection kernels against the scalar one on random
+// spheres, testing them in leaf-sized groups like rayHit() does.
+
+enum { SPHERES = 4096, RAYS = 4096, GROUP = SOA_LANES };
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static double rnd(double lo, double hi)
+{
+	return lo + (hi - lo) * ((double)rand() / (double)RAND_MAX);
+}
+
+int main(void)
+{
+	const char *names[] = {"scalar", "sse2", "avx2", "avx512"};
+	Object *objs = malloc(sizeof(Object) * SPHERES);
+	Ray *rays = malloc(sizeof(Ray) * RAYS);
+	int *ref = malloc(sizeof(int) * RAYS);
+	Bvh bvh;
+	SceneSoA soa;
+
+	srand(1);
+	for (int i = 0; i < SPHERES; i++)
+	{
+		Vec3 o = {rnd(-20.0, 20.0), rnd(-15.0, 15.0), rnd(-60.0, -5.0)};
+		objs[i] = (Object) {OBJ_SPHERE, {1.0, 1.0, 1.0}, {.sp = {o, rnd(0.05, 1.5)}}};
+	}
+	for (int i = 0; i < RAYS; i++)
+	{
+		Vec3 d = {rnd(-1.0, 1.0), rnd(-0.75, 0.75), -1.0};
+		rays[i] = (Ray) {{0.0, 0.0, 0.0}, norm(&d)};
+	}
+
+	bvhBuild(&bvh, objs, SPHERES, 1);
+	soaBuild(&soa, objs, &bvh);
+
+	double base = 0.0;
+	for (int n = 0; n < 4; n++)
+	{
+		const Kernel *k = kernelSelect(names[n]);
+		if (k == NULL)
+		{
+			printf("%-7s not supported\n", names[n]);
+			continue;
+		}
+
+		int mismatches = 0;
+		double start = now();
+		for (int i = 0; i < RAYS; i++)
+		{
+			real t = REAL_MAX;
+			int objI = -1;
+			for (int g = 0; g < SPHERES; g += GROUP)
+				k->hitSpheres(&soa, g, GROUP, &rays[i], &t, &objI, 0);
+
+			if (n == 0)
+				ref[i] = objI;
+			else if (ref[i] != objI)
+				mismatches++;
+		}
+		double secs = now() - start;
+
+		if (n == 0)
+			base = secs;
+		printf("%-7s %8.1f Mtests/s  %5.2fx  %d mismatches\n", k->name,
+			   (double)SPHERES * RAYS / secs * 1e-6, base / secs, mismatches);
+	}
+
+	soaFree(&soa);
+	bvhFree(&bvh);
+	free(ref);
+	free(rays);
+	free(objs);
+
+	return 0;
+}
@@ -0,0 +1,236 @@
+#include "kernel.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KERNEL_X86 1
+#endif
+
+static int hitSpheresScalar(const SceneSoA *soa, int first, int count,
+							const Ray *r, real *t, int *objI, int once)
+{
+	int found = 0;
+
+	for (int k = first; k < first + count; k++)
+	{
+		Vec3 a = {soa->cx[k] - r->o.x, soa->cy[k] - r->o.y, soa->cz[k] - r->o.z};
+		real b = dot(&a, (Vec3 *)&r->d);
+		real c = dot(&a, &a) - b * b;
+
+		if (c > soa->r2[k])
+			continue;
+
+		real tH = sqrt(soa->r2[k] - c);
+		real t0 = b - tH;
+
+		if (t0 < 0.0)
+		{
+			t0 = b + tH;
+			if (t0 < 0.0)
+				continue;
+		}
+
+		if (closer(t0, soa->sphereId[k], *t, *objI))
+		{
+			*t = t0;
+			*objI = soa->sphereId[k];
+			found = 1;
+			if (once)
+				return 1;
+		}
+	}
+
+	return found;
+}
+
+static int hitPlanesScalar(const SceneSoA *soa, int first, int count,
+						   const Ray *r, real *t, int *objI, int once)
+{
+	int found = 0;
+
+	for (int k = first; k < first + count; k++)
+	{
+		Vec3 n = {soa->nx[k], soa->ny[k], soa->nz[k]};
+		real denom = dot(&n, (Vec3 *)&r->d);
+
+		if (denom > (real)1e-6)
+		{
+			Vec3 p0 = {soa->px[k] - r->o.x, soa->py[k] - r->o.y, soa->pz[k] - r->o.z};
+			real t0 = dot(&p0, &n) / denom;
+
+			if (t0 >= 0 && closer(t0, soa->planeId[k], *t, *objI))
+			{
+				*t = t0;
+				*objI = soa->planeId[k];
+				found = 1;
+				if (once)
+					return 1;
+			}
+		}
+	}
+
+	return found;
+}
+
+// Operation order matches kernel.inc exactly. A ray parallel to the
+// triangle gets det = 0 and NaN or infinite u, which fail the tests.
+static int hitTrisScalar(const TriSoA *tri, int first, int count,
+						 const Ray *r, real *t, int *objI, int once)
+{
+	real dx = r->d.x, dy = r->d.y, dz = r->d.z;
+	int found = 0;
+
+	for (int k = first; k < first + count; k++)
+	{
+		real ax = tri->ax[k], ay = tri->ay[k], az = tri->az[k];
+		real bx = tri->bx[k], by = tri->by[k], bz = tri->bz[k];
+
+		real px = dy * bz - dz * by, py = dz * bx - dx * bz, pz = dx * by - dy * bx;
+		real inv = (real)1.0 / (ax * px + ay * py + az * pz);
+
+		real sx = r->o.x - tri->vx[k], sy = r->o.y - tri->vy[k], sz = r->o.z - tri->vz[k];
+		real u = (sx * px + sy * py + sz * pz) * inv;
+
+		real qx = sy * az - sz * ay, qy = sz * ax - sx * az, qz = sx * ay - sy * ax;
+		real v = (dx * qx + dy * qy + dz * qz) * inv;
+		real t0 = (bx * qx + by * qy + bz * qz) * inv;
+
+		if (!(u >= 0.0 && v >= 0.0 && u + v <= 1.0 && t0 >= 0.0 && t0 <= *t))
+			continue;
+
+		if (closer(t0, tri->triId[k], *t, *objI))
+		{
+			*t = t0;
+			*objI = tri->triId[k];
+			found = 1;
+			if (once)
+				return 1;
+		}
+	}
+
+	return found;
+}
+
+static const Kernel scalarKernel = {
+	"scalar", 1, hitSpheresScalar, hitPlanesScalar, hitTrisScalar
+};
+
+#ifdef KERNEL_X86
+
+// Intrinsic names and lane counts for real: VP(_mm256_add) is
+// _mm256_add_pd, or _mm256_add_ps in the float build with twice the lanes.
+// VPM() is the same for the AVX-512 compares that return a mask.
+#ifdef RAYS_FLOAT
+#define VP(f) f##_ps
+#define VPM(f) f##_ps_mask
+#define VT(bits) __m##bits
+#define PER_128 4
+#else
+#define VP(f) f##_pd
+#define VPM(f) f##_pd_mask
+#define VT(bits) __m##bits##d
+#define PER_128 2
+#endif
+
+// SSE2 is part of x86-64, no target switch needed
+#define KNAME(x) x##Sse2
+#define KSTR "sse2"
+#define LANES PER_128
+#define VR VT(128)
+#define VM VT(128)
+#define VLOAD(p) VP(_mm_loadu)(p)
+#define VSTORE(p, v) VP(_mm_store)(p, v)
+#define VSET1(x) VP(_mm_set1)(x)
+#define VADD(a, b) VP(_mm_add)(a, b)
+#define VSUB(a, b) VP(_mm_sub)(a, b)
+#define VMUL(a, b) VP(_mm_mul)(a, b)
+#define VDIV(a, b) VP(_mm_div)(a, b)
+#define VSQRT(a) VP(_mm_sqrt)(a)
+#define VLT(a, b) VP(_mm_cmplt)(a, b)
+#define VLE(a, b) VP(_mm_cmple)(a, b)
+#define VGE(a, b) VP(_mm_cmpge)(a, b)
+#define VGT(a, b) VP(_mm_cmpgt)(a, b)
+#define VAND(a, b) VP(_mm_and)(a, b)
+#define VBLEND(m, x, y) VP(_mm_or)(VP(_mm_and)(m, y), VP(_mm_andnot)(m, x))
+#define VBITS(m) VP(_mm_movemask)(m)
+#include "kernel.inc"
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#define KNAME(x) x##Avx2
+#define KSTR "avx2"
+#define LANES (2 * PER_128)
+#define VR VT(256)
+#define VM VT(256)
+#define VLOAD(p) VP(_mm256_loadu)(p)
+#define VSTORE(p, v) VP(_mm256_store)(p, v)
+#define VSET1(x) VP(_mm256_set1)(x)
+#define VADD(a, b) VP(_mm256_add)(a, b)
+#define VSUB(a, b) VP(_mm256_sub)(a, b)
+#define VMUL(a, b) VP(_mm256_mul)(a, b)
+#define VDIV(a, b) VP(_mm256_div)(a, b)
+#define VSQRT(a) VP(_mm256_sqrt)(a)
+#define VLT(a, b) VP(_mm256_cmp)(a, b, _CMP_LT_OQ)
+#define VLE(a, b) VP(_mm256_cmp)(a, b, _CMP_LE_OQ)
+#define VGE(a, b) VP(_mm256_cmp)(a, b, _CMP_GE_OQ)
+#define VGT(a, b) VP(_mm256_cmp)(a, b, _CMP_GT_OQ)
+#define VAND(a, b) VP(_mm256_and)(a, b)
+#define VBLEND(m, x, y) VP(_mm256_blendv)(x, y, m)
+#define VBITS(m) VP(_mm256_movemask)(m)
+#include "kernel.inc"
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#define KNAME(x) x##Avx512
+#define KSTR "avx512"
+#define LANES (4 * PER_128)
+#define VR VT(512)
+#ifdef RAYS_FLOAT
+#define VM __mmask16
+#else
+#define VM __mmask8
+#endif
+#define VLOAD(p) VP(_mm512_loadu)(p)
+#define VSTORE(p, v) VP(_mm512_store)(p, v)
+#define VSET1(x) VP(_mm512_set1)(x)
+#define VADD(a, b) VP(_mm512_add)(a, b)
+#define VSUB(a, b) VP(_mm512_sub)(a, b)
+#define VMUL(a, b) VP(_mm512_mul)(a, b)
+#define VDIV(a, b) VP(_mm512_div)(a, b)
+#define VSQRT(a) VP(_mm512_sqrt)(a)
+#define VLT(a, b) VPM(_mm512_cmp)(a, b, _CMP_LT_OQ)
+#define VLE(a, b) VPM(_mm512_cmp)(a, b, _CMP_LE_OQ)
+#define VGE(a, b) VPM(_mm512_cmp)(a, b, _CMP_GE_OQ)
+#define VGT(a, b) VPM(_mm512_cmp)(a, b, _CMP_GT_OQ)
+#define VAND(a, b) ((a) & (b))
+#define VBLEND(m, x, y) VP(_mm512_mask_blend)(m, x, y)
+#define VBITS(m) ((int)(m))
+#include "kernel.inc"
+#pragma GCC pop_options
+
+#endif
+
+const Kernel *kernelSelect(const char *name)
+{
+	const Kernel *all[4] = {&scalarKernel, NULL, NULL, NULL};
+	int n = 1;
+
+#ifdef KERNEL_X86
+	__builtin_cpu_init();
+	all[n++] = &kernelSse2;
+	if (__builtin_cpu_supports("avx2"))
+		all[n++] = &kernelAvx2;
+	if (__builtin_cpu_supports("avx512f"))
+		all[n++] = &kernelAvx512;
+#endif
+
+	if (name == NULL)
+		return all[n - 1];
+
+	for (int i = 0; i < n; i++)
+		if (strcmp(all[i]->name, name) == 0)
+			return all[i];
+
+	return NULL;
+}
@@ -0,0 +1,35 @@
+#ifndef KERNEL_H
+#define KERNEL_H
+#include "obj.h"
+#include "soa.h"
+
+// Tests soa slots [first, first + count) against r and updates the closest
+// hit in *t / *objI. With once set it returns as soon as anything is hit.
+// Returns 1 if the closest hit changed.
+typedef int (*HitFn)(const SceneSoA *soa, int first, int count,
+					 const Ray *r, real *t, int *objI, int once);
+
+// Same for triangles, double sided Möller-Trumbore
+typedef int (*TriFn)(const TriSoA *tri, int first, int count,
+					 const Ray *r, real *t, int *objI, int once);
+
+typedef struct Kernel {
+	const char *name;
+	int lanes;
+	HitFn hitSpheres;
+	HitFn hitPlanes;
+	TriFn hitTris;
+} Kernel;
+
+// Returns the named kernel ("scalar", "sse2", "avx2", "avx512"), or the
+// widest one this CPU supports when name is NULL. NULL if unavailable.
+const Kernel *kernelSelect(const char *name);
+
+// Keeps the closest hit, breaking ties on the lower object index so the
+// result matches a linear scan over the objects in order
+static inline int closer(real t0, int i, real best, int bestI)
+{
+	return t0 < best || (t0 == best && i < bestI);
+}
+
+#endif
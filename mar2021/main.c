@@ -1,242 +1,423 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
 #include "gifenc.h"
 #include "parser.h"
+#include "render.h"
+#include "scb.h"
+#include "stats.h"
+#include "trace.h"
 
-#define DBL_MAX 1.7976931348623158e+308
-
-enum { WIDTH = 800, HEIGHT = 600 };
-const double ASR = (double)WIDTH/(double)HEIGHT;
-const double FOV = 1.5708;
-
-const double DARKEST = 0.5;
-
-Ray newRay(int x, int y);
+void applyDithering(Vec3 *bufferIn, uint8_t *bufferOut);
 
-int rayHit(Ray *r, Object *objs, int objsLen, double *t, int once);
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
 
-int hitSphere(Sphere *s, Ray *r, double *t);
-int hitPlane(Plane *p, Ray *r, double *t);
+// Writes a one frame GIF next to path and renames it over path, so a viewer
+// watching path never reads a half written preview
+static int writeStill(const char *path, const uint8_t *frame, int width, int height, int delay, int threads)
+{
+	char tmp[4096];
+	if (snprintf(tmp, sizeof(tmp), "%s.part", path) >= (int)sizeof(tmp))
+		return 0;
 
-Vec3 getNormal(Object *obj, Vec3 *hitP);
+	ge_GIF *gif = ge_new_gif(tmp, width, height, NULL, 8, 0);
+	if (gif == NULL)
+		return 0;
+	ge_set_threads(gif, threads);
+	memcpy(gif->frame, frame, (size_t)width * height);
+	ge_add_frame(gif, delay);
+	ge_close_gif(gif);
 
-void swap(double *a, double *b);
-uint8_t getNearestSafeColor(Vec3 *c, Vec3 *err);
-void applyDithering(Vec3 *bufferIn, uint8_t *bufferOut);
+	return rename(tmp, path) == 0;
+}
 
-int main(int argc, char *argv[])
+// Progressive passes: every 4th pixel of every 4th row, then every 2nd,
+// then the rest, with the gaps interpolated and path rewritten after each.
+// Every pixel is traced once and tracePixel() matches the packet path, so
+// a finished run writes the same file as a normal one. With a budget
+// (seconds), a pass that the timing so far says would overrun it is not
+// started.
+static int renderProgressive(Scene *sc, const char *path, Sched *pool, double budget, int verbose)
 {
-	if (argc == 1)
+	static const int steps[] = {4, 2, 1};
+	// Share of the pixels each pass traces
+	static const double share[] = {1.0 / 16.0, 3.0 / 16.0, 12.0 / 16.0};
+	size_t frameSize = (size_t)sc->WIDTH * sc->HEIGHT;
+	uint8_t *frame = malloc(frameSize);
+	double start = now();
+	double perPixel = 0.0;
+
+	if (frame == NULL)
 	{
-		printf("No scene file specified: 'rays scene.sc'. Quitting...\n");
-		return 1;
+		printf("Out of memory. Quitting...\n");
+		return 0;
 	}
 
-	Scene sc = {NULL, 0, {{0.0, 0.0, 0.0}, 0.0},
-				(int)WIDTH, (int)HEIGHT, ASR, FOV, DARKEST};
-
-	parseScene(argv[1], &sc);
+	for (int p = 0; p < 3; p++)
+	{
+		double passStart = now();
+		if (p > 0 && budget > 0.0 && passStart - start + perPixel * share[p] * frameSize > budget)
+		{
+			if (verbose)
+				fprintf(stderr, "Stopped after pass %d to stay within %.0f ms\n", p, budget * 1e3);
+			break;
+		}
 
-	char *outPath = "rays.gif";
+		renderSparse(sc, frame, steps[p], (p > 0) ? steps[p - 1] : 0, pool);
+		perPixel = (now() - passStart) / (share[p] * frameSize);
 
-	if (argc >= 3)
-		outPath = argv[2];
+		if (!writeStill(path, frame, sc->WIDTH, sc->HEIGHT, sc->anim.delay, schedThreads(pool)))
+		{
+			printf("Could not write '%s'.\n", path);
+			free(frame);
+			return 0;
+		}
+		if (verbose)
+			fprintf(stderr, "Pass %d/3, 1 in %d pixels traced: written at %.2f ms\n", p + 1,
+					steps[p] * steps[p], (now() - start) * 1e3);
+	}
 
-	ge_GIF *gif = ge_new_gif(outPath, sc.WIDTH, sc.HEIGHT, NULL, 8, 0);
-	
-	// for (int i = 0; i < 125; i++)
-	// {
-		// worldObjs[0].obj.sp.o.y = sin(i * 0.15);
-		// worldObjs[1].obj.sp.o.x = 5.0 + sin(i * 0.2);
-		// worldObjs[1].obj.sp.o.z = -10.0 - sin(i * 0.1);
+	free(frame);
+	return 1;
+}
 
-		for (int y = 0; y < sc.HEIGHT; y++)
+int main(int argc, char *argv[])
+{
+	int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	int verbose = 0;
+	char *kernel = NULL;
+	int packets = 1;
+	int progressive = 0;
+	double budget = 0.0;
+	char *rawPath = NULL;
+	char *statsPath = NULL;
+	char *tracePath = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:d:j:k:psS:T:v")) != -1)
+	{
+		switch (opt)
 		{
-			for (int x = 0; x < sc.WIDTH; x++)
-			{
-				
-				Ray r = newRay(x, y);
-
-				double t = 0.0;
-				int objI = rayHit(&r, sc.objs, sc.objsLen, &t, 0);
-				if (objI >= 0)
-				{
-					Vec3 rDist = scale(&r.d, t);
-					Vec3 hitP = add(&r.o, &rDist);
-
-					Vec3 newDir = sub(&sc.li.o, &hitP);
-					double lightMag = mag(&newDir);
-					newDir = norm(&newDir);
-					Vec3 objNorm = getNormal(&(sc.objs[objI]), &hitP);
-					// Vec3 rayO = scale(&objNorm, 1e-4);
-					// rayO = add(&rayO, &hitP);
-					// Ray shadowRay = {rayO, newDir};
-
-					// double p = 0.0;
-					// if (rayHit(&shadowRay, worldObjs, worldObjsLen, &p, 1) >= 0 && lInt >= DARKEST)
-					// {
-					// 	buffer[x+(WIDTH*y)] = 245;
-					// }
-					// else
-					// {
-						double lInt = dot(&objNorm, &newDir) * sc.li.r / pow(lightMag, 2.0);
-						lInt = (lInt >= DARKEST) ? lInt : DARKEST;
-						lInt = (lInt > 1) ? 1 : lInt;
-						Vec3 col = scale(&(sc.objs[objI].color), lInt);
-						gif->frame[x + (WIDTH * y)] = getNearestSafeColor(&col, NULL);
-					// }
-				}
-				else
-				{
-					gif->frame[x + (WIDTH * y)] = 0;
-				}
-			}
+			case 'b':
+				budget = atof(optarg) * 1e-3;
+				progressive = 1;
+				break;
+			case 'd':
+				rawPath = optarg;
+				break;
+			case 'j':
+				threads = atoi(optarg);
+				break;
+			case 'k':
+				kernel = optarg;
+				break;
+			case 'p':
+				progressive = 1;
+				break;
+			case 's':
+				packets = 0;
+				break;
+			case 'S':
+				statsPath = optarg;
+				break;
+			case 'T':
+				tracePath = optarg;
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			default:
+				printf("Usage: 'rays [-j threads] [-k scalar|sse2|avx2|avx512] [-s] [-p] [-b budget_ms] [-d frames.raw] [-S stats.json] [-T trace.json] [-v] scene.sc|scene.scb [out.gif]'\n"
+					   "       'rays compile scene.sc scene.scb'\n");
+				return 1;
 		}
+	}
 
-		ge_add_frame(gif, 7);
-	// }
-
-	ge_close_gif(gif);
+	// 'rays compile scene.sc scene.scb' stores the built scene for mapping
+	int compile = (optind < argc && strcmp(argv[optind], "compile") == 0);
+	optind += compile;
 
-	free(sc.objs);
+	if (optind >= argc || (compile && optind + 1 >= argc))
+	{
+		printf("No scene file specified: 'rays scene.sc' or 'rays compile scene.sc scene.scb'. Quitting...\n");
+		return 1;
+	}
 
-	return 0;
-}
+	Scene sc = {NULL, 0, {{0.0, 0.0, 0.0}, 0.0},
+				(int)WIDTH, (int)HEIGHT, ASR, FOV, DARKEST, {0}, {0}, NULL, packets,
+				{1, 7, NULL, 0, 0}, NULL, 0, {0}, {0}, {0}, {.at = {0.0, 0.0, -1.0}}};
 
-Ray newRay(int x, int y)
-{
-	double fov = tan(FOV / 2.0);
-	double rX = ((((double)x + 0.5) / (double)WIDTH) * 2.0 - 1.0) * ASR * fov;
-	double rY = (1.0 - (((double)y + 0.5) / (double)HEIGHT) * 2.0) * fov;
+	sc.kern = kernelSelect(kernel);
+	if (sc.kern == NULL)
+	{
+		printf("Kernel '%s' is not supported on this CPU. Quitting...\n", kernel);
+		return 1;
+	}
 
-	Vec3 dir = {rX, rY, -1.0};
+#ifndef RAYS_STATS
+	if (statsPath != NULL)
+	{
+		printf("Stats need a build with RAYS_STATS ('make rays_stats'). Quitting...\n");
+		return 1;
+	}
+#endif
 
-	return (Ray) {{0.0, 0.0, 0.0}, norm(&dir)};
-}
+	// Before any thread starts, so the pool and encoder threads are named
+	if (tracePath != NULL)
+		traceStart();
 
-int rayHit(Ray *r, Object *objs, int objsLen, double *t, int once)
-{
-	double t0 = 0.0;
-	double big = DBL_MAX;
-	int objI = -1;
+	double loadStart = now();
 
-	for (int i = 0; i < objsLen; i++)
+	if (scbIs(argv[optind]))
 	{
-		int hit = 0;
-
-		switch (objs[i].type)
+		STATS_BEGIN(parse);
+		TRACE_BEGIN(start);
+		int ok = scbLoad(argv[optind], &sc);
+		TRACE_END(start, "map scene", "objects", sc.objsLen);
+		STATS_END(PHASE_PARSE, parse);
+		if (!ok)
 		{
-			// Sphere intersection
-			case 0:
-				hit = hitSphere(&objs[i].obj.sp, r, &t0);
-				break;
-			// Plane intersection
-			case 1:
-				hit = hitPlane(&objs[i].obj.pl, r, &t0);
-				break;
-			default:
-				break;
+			printf("Compiled scene '%s' is damaged or from another build. Quitting...\n", argv[optind]);
+			return 1;
+		}
+		if (verbose)
+			fprintf(stderr, "Mapped %d objects in %.2f ms\n", sc.objsLen, (now() - loadStart) * 1e3);
+	}
+	else
+	{
+		double parseMbs = 0.0;
+		STATS_BEGIN(parse);
+		TRACE_BEGIN(start);
+		int ok = parseScene(argv[optind], &sc, &parseMbs);
+		TRACE_END(start, "parse", "objects", sc.objsLen);
+		STATS_END(PHASE_PARSE, parse);
+		if (!ok)
+		{
+			printf("Could not read scene '%s'. Quitting...\n", argv[optind]);
+			return 1;
 		}
 
-		if (hit && t0 < big)
+		STATS_BEGIN(build);
+		TRACE_BEGIN(built);
+		ok = bvhBuild(&sc.bvh, sc.objs, sc.objsLen, sc.kern->lanes) && soaBuild(&sc.soa, sc.objs, &sc.bvh) &&
+			 bvhBuildTris(&sc.triBvh, &sc.mesh, sc.kern->lanes) &&
+			 triSoaBuild(&sc.tris, &sc.mesh, &sc.triBvh, sc.objsLen);
+		TRACE_END(built, "build", "objects", sc.objsLen);
+		STATS_END(PHASE_BUILD, build);
+		if (!ok)
 		{
-			big = t0;
-			objI = i;
-			if (once)
-				break;
+			printf("Out of memory. Quitting...\n");
+			return 1;
 		}
+		if (verbose)
+			fprintf(stderr, "Parsed %d objects and %d triangles at %.1f MB/s, built in %.2f ms\n", sc.objsLen,
+					sc.mesh.facesLen, parseMbs, (now() - loadStart) * 1e3);
 	}
 
-	*t = big;
-	return objI;
-}
-
-int hitSphere(Sphere *s, Ray *r, double *t)
-{
-	Vec3 a = sub(&s->o, &r->o);
-	double b = dot(&a, &r->d);
-	double c = dot(&a, &a) - pow(b, 2.0);
-	double r2 = pow(s->r, 2.0);
+	if (compile)
+	{
+		int ok = scbWrite(argv[optind + 1], &sc);
+		if (!ok)
+			printf("Could not write '%s'.\n", argv[optind + 1]);
+		sceneFree(&sc);
+		return !ok;
+	}
 
-	if (c > r2)
-		return 0;
-	
-	double tH = sqrt(r2 - c);
-	double t0 = b - tH, t1 = b + tH;
+	char *outPath = "rays.gif";
 
-	if (t0 > t1)
-		swap(&t0, &t1);
+	if (argc - optind >= 2)
+		outPath = argv[optind + 1];
 
-	if (t0 < 0.0)
+	Sched *pool = schedNew(threads);
+	if (pool == NULL)
 	{
-		t0 = t1;
-		if (t0 < 0.0)
-			return 0;
+		printf("Out of memory. Quitting...\n");
+		sceneFree(&sc);
+		return 1;
 	}
 
-	*t = t0;
-	
-	return 1;
-}
+	// Progressive previews are for tuning stills, animations render as usual
+	if (progressive && sc.anim.keysLen == 0)
+	{
+		int ok = renderProgressive(&sc, outPath, pool, budget, verbose);
+		schedFree(pool);
+		if (tracePath != NULL && !traceWrite(tracePath))
+			printf("Could not write '%s'.\n", tracePath);
+#ifdef RAYS_STATS
+		Stats total;
+		statsCollect(&total);
+		statsPrint(&total, 1);
+		if (statsPath != NULL && !statsWriteJson(statsPath, &total, &total, &(int) {1}, 1))
+			printf("Could not write '%s'.\n", statsPath);
+#endif
+		sceneFree(&sc);
+		return !ok;
+	}
 
-int hitPlane(Plane *p, Ray *r, double *t)
-{
-	double denom = dot(&p->n, &r->d);
+	// The palette indices of every frame as traced, for comparing builds
+	FILE *raw = NULL;
+	if (rawPath != NULL && (raw = fopen(rawPath, "wb")) == NULL)
+	{
+		printf("Could not write '%s'. Quitting...\n", rawPath);
+		return 1;
+	}
 
-	if (denom > 1e-6)
+	ge_GIF *gif = ge_new_gif(outPath, sc.WIDTH, sc.HEIGHT, NULL, 8, 0);
+	ge_set_threads(gif, threads);
+	ge_set_tiles(gif, TILE);
+	
+	// Animated frames are posed and traced a batch at a time so the pool
+	// works on several frames at once; they still reach the encoder in order
+	Anim *anim = &sc.anim;
+	int batch = (anim->keysLen > 0) ? schedThreads(pool) : 1;
+	batch = (batch < anim->frames) ? batch : anim->frames;
+
+	size_t frameSize = (size_t)sc.WIDTH * sc.HEIGHT;
+	Scene *poses = malloc(sizeof(Scene) * batch);
+	Scene **scs = malloc(sizeof(Scene *) * batch);
+	uint8_t **frames = malloc(sizeof(uint8_t *) * batch);
+	uint8_t *pixels = (batch > 1) ? malloc(frameSize * batch) : NULL;
+
+	// Per frame tile masks: only what moved since the previous frame is traced
+	int tiles = ((sc.WIDTH + TILE - 1) / TILE) * ((sc.HEIGHT + TILE - 1) / TILE);
+	long traced = 0;
+	uint8_t **dirty = malloc(sizeof(uint8_t *) * batch);
+	uint8_t *masks = malloc((size_t)tiles * batch);
+
+	if (poses == NULL || scs == NULL || frames == NULL || (batch > 1 && pixels == NULL) ||
+		dirty == NULL || masks == NULL)
 	{
-		Vec3 p0 = sub(&p->o, &r->o);
-		*t = dot(&p0, &p->n) / denom;
-		return (t != NULL && *t >= 0);
+		printf("Out of memory. Quitting...\n");
+		return 1;
 	}
 
-	return 0;
-}
+#ifdef RAYS_STATS
+	// What each batch of frames cost, the encoder's share lands in whichever
+	// batch is being traced while it runs
+	int batches = (anim->frames + batch - 1) / batch;
+	Stats *batchStats = malloc(sizeof(Stats) * batches);
+	int *batchFrames = malloc(sizeof(int) * batches);
+	Stats prevStats;
+	if (batchStats == NULL || batchFrames == NULL)
+	{
+		printf("Out of memory. Quitting...\n");
+		return 1;
+	}
+	statsCollect(&prevStats);
+#endif
 
-Vec3 getNormal(Object *obj, Vec3 *hitP)
-{
-	Vec3 out = {0.0, 0.0, 0.0};
+	double start = now();
 
-	switch (obj->type)
+	for (int f = 0; f < anim->frames; f += batch)
 	{
-		// Sphere Normal
-		case 0:
-			out = sub(hitP, &(obj->obj.sp.o));
-			out = norm(&out);
-			break;
-		// Plane normal
-		case 1:
-			out = obj->obj.pl.n;
-			break;
-		default:
-			break;
+		int n = (anim->frames - f < batch) ? anim->frames - f : batch;
+
+		TRACE_BEGIN(pose);
+		if (anim->keysLen > 0 && !animPoseFrames(&sc, f, n, poses, pool))
+		{
+			printf("Could not build frame %d. Quitting...\n", f);
+			return 1;
+		}
+		TRACE_END(pose, "pose", "frame", f);
+
+		for (int i = 0; i < n; i++)
+		{
+			scs[i] = (anim->keysLen > 0) ? &poses[i] : &sc;
+			frames[i] = (batch > 1) ? pixels + frameSize * i : gif->frame;
+			dirty[i] = masks + (size_t)tiles * i;
+			renderDirty(&sc, f + i, dirty[i]);
+		}
+
+		TRACE_BEGIN(render);
+		int count = renderFrames(scs, frames, dirty, n, pool);
+		TRACE_END(render, "render frames", "frame", f);
+		if (count < 0)
+		{
+			printf("Out of memory. Quitting...\n");
+			return 1;
+		}
+		traced += count;
+
+		for (int i = 0; i < n; i++)
+		{
+			// The previous frame is complete by now, gif->back holds the last one sent
+			TRACE_BEGIN(add);
+			if (f + i > 0)
+				renderCopyClean((i > 0) ? frames[i - 1] : gif->back, frames[i], dirty[i], sc.WIDTH, sc.HEIGHT);
+
+			if (batch > 1)
+				memcpy(gif->frame, frames[i], frameSize);
+			// Untraced tiles are copies, the encoder needs to look at the rest only
+			if (gif->dirty != NULL)
+				memcpy(gif->dirty, dirty[i], tiles);
+			if (raw != NULL)
+				fwrite(gif->frame, 1, frameSize, raw);
+			ge_add_frame(gif, anim->delay);
+			TRACE_END(add, "add frame", "frame", f + i);
+
+			if (anim->keysLen > 0)
+				animRelease(&poses[i]);
+		}
+
+#ifdef RAYS_STATS
+		Stats cur;
+		statsCollect(&cur);
+		for (int i = 0; i < STAT_COUNTERS; i++)
+			batchStats[f / batch].count[i] = cur.count[i] - prevStats.count[i];
+		for (int i = 0; i < STAT_PHASES; i++)
+			batchStats[f / batch].cycles[i] = cur.cycles[i] - prevStats.cycles[i];
+		batchFrames[f / batch] = n;
+		prevStats = cur;
+#endif
 	}
 
-	return out;
-}
+	double secs = now() - start;
+
+	if (verbose)
+		fprintf(stderr, "Rendered %d frame(s) of %dx%d in %.2f ms, %.2f Mrays/s, %.1f%% of tiles traced (%d threads, %s kernel, %s, %s)\n",
+				anim->frames, sc.WIDTH, sc.HEIGHT, secs * 1e3, (double)frameSize * anim->frames / secs * 1e-6,
+				100.0 * traced / ((double)tiles * anim->frames), schedThreads(pool), sc.kern->name,
+				sc.packets ? "packets" : "single rays", (sizeof(real) == sizeof(float)) ? "float" : "double");
+
+	if (raw != NULL)
+		fclose(raw);
+	free(masks);
+	free(dirty);
+	free(pixels);
+	free(frames);
+	free(scs);
+	free(poses);
+
+	schedFree(pool);
+	TRACE_BEGIN(close);
+	ge_close_gif(gif);
+	TRACE_END(close, "close gif", "frames", anim->frames);
 
-void swap(double *a, double *b)
-{
-	double t;
+	// The pool and encoder threads are joined, their rings are complete
+	if (tracePath != NULL && !traceWrite(tracePath))
+		printf("Could not write '%s'.\n", tracePath);
 
-	t  = *b;
-	*b = *a;
-	*a = t;
-}
+#ifdef RAYS_STATS
+	// After closing, so the encoder's last frames are in the totals
+	Stats total;
+	statsCollect(&total);
+	statsPrint(&total, anim->frames);
+	if (statsPath != NULL && !statsWriteJson(statsPath, &total, batchStats, batchFrames, batches))
+		printf("Could not write '%s'.\n", statsPath);
+	free(batchFrames);
+	free(batchStats);
+#endif
 
-uint8_t getNearestSafeColor(Vec3 *c, Vec3 *err)
-{
-	uint8_t r = (uint8_t)(round(c->x * 5) * 51);
-	uint8_t g = (uint8_t)(round(c->y * 5) * 51);
-	uint8_t b = (uint8_t)(round(c->z * 5) * 51);
-	
-	Vec3 newCol = {(float)r, (float)g, (float)b};
-	if (err != NULL)
-		*err = sub(c, &newCol);
+	sceneFree(&sc);
 
-	return (((uint8_t)newCol.z/0x33) + ((uint8_t)newCol.y/0x33)*6 + ((uint8_t)newCol.x/0x33)*36 + 16) % 256;
+	return 0;
 }
 
 // void applyDithering(Vec3 *bufferIn, uint8_t *bufferOut)
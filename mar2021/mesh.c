@@ -0,0 +1,51 @@
+#include "mesh.h"
+#include <stdlib.h>
+
+int meshAddVert(Mesh *m, Vec3 v)
+{
+	if (m->vertsLen == m->vertsCap)
+	{
+		int cap = (m->vertsCap > 0) ? m->vertsCap * 2 : 1024;
+		Vec3 *verts = realloc(m->verts, sizeof(Vec3) * cap);
+		if (verts == NULL)
+			return 0;
+		m->verts = verts;
+		m->vertsCap = cap;
+	}
+
+	m->verts[m->vertsLen++] = v;
+	return 1;
+}
+
+int meshAddFace(Mesh *m, Face f)
+{
+	if (m->facesLen == m->facesCap)
+	{
+		int cap = (m->facesCap > 0) ? m->facesCap * 2 : 1024;
+		Face *faces = realloc(m->faces, sizeof(Face) * cap);
+		if (faces == NULL)
+			return 0;
+		m->faces = faces;
+		m->facesCap = cap;
+	}
+
+	m->faces[m->facesLen++] = f;
+	return 1;
+}
+
+void meshFree(Mesh *m)
+{
+	free(m->verts);
+	free(m->faces);
+	*m = (Mesh) {NULL, 0, 0, NULL, 0, 0};
+}
+
+Vec3 meshNormal(const Mesh *m, int f)
+{
+	const Face *fc = &m->faces[f];
+	Vec3 e1 = sub(&m->verts[fc->v[1]], &m->verts[fc->v[0]]);
+	Vec3 e2 = sub(&m->verts[fc->v[2]], &m->verts[fc->v[0]]);
+	Vec3 n = cross(&e1, &e2);
+
+	return norm(&n);
+}
@@ -0,0 +1,27 @@
+#ifndef MESH_H
+#define MESH_H
+#include "obj.h"
+
+// Triangle of the scene mesh, obj is the index of the OBJ_MESH object it
+// belongs to (which holds its colour)
+typedef struct Face {
+	int v[3];
+	int obj;
+} Face;
+
+// Indexed triangle store shared by all mesh objects of a scene
+typedef struct Mesh {
+	Vec3 *verts;
+	int vertsLen, vertsCap;
+	Face *faces;
+	int facesLen, facesCap;
+} Mesh;
+
+int meshAddVert(Mesh *m, Vec3 v);
+int meshAddFace(Mesh *m, Face f);
+void meshFree(Mesh *m);
+
+// Unit normal by the winding of face f
+Vec3 meshNormal(const Mesh *m, int f);
+
+#endif
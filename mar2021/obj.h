@@ -9,7 +9,7 @@ typedef struct Ray {
 
 typedef struct Sphere {
 	Vec3 o;
-	double r;
+	real r;
 } Sphere;
 
 typedef struct Plane {
@@ -17,8 +17,20 @@ typedef struct Plane {
 	Vec3 n;
 } Plane;
 
+// Faces [first, first + count) of the scene mesh, already moved to o and
+// scaled when the OBJ file was read
+typedef struct MeshRef {
+	Vec3 o;
+	double scale;
+	int first;
+	int count;
+} MeshRef;
+
 typedef Sphere Light;
 
+// Object types, meshes keep their triangles in the scene's Mesh
+enum { OBJ_SPHERE = 0, OBJ_PLANE = 1, OBJ_MESH = 2 };
+
 typedef struct Object {
 	int type;
 	Vec3 color;
@@ -26,6 +38,7 @@ typedef struct Object {
 	{
 		Sphere sp;
 		Plane pl;
+		MeshRef ms;
 	} obj;
 } Object;
 
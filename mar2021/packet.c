@@ -0,0 +1,216 @@
+#include "packet.h"
+#include "render.h"
+#include "stats.h"
+#include <string.h>
+
+// Sub-trees reached by this many rays or fewer are finished one ray at a time
+enum { DIVERGED = PACKET_RAYS / 8 };
+
+void packetInit(Packet *p, const Camera *cam, int x0, int y0, int w, int h)
+{
+	p->valid = 0;
+
+	for (int j = 0; j < PACKET; j++)
+	{
+		// Lanes past the edge repeat the last real pixel so they hold sane values
+		Ray *row = &p->rays[PACKET * j];
+		if (j < h)
+			cameraRow(cam, x0, y0 + j, w, row);
+		else
+			memcpy(row, row - PACKET, sizeof(Ray) * PACKET);
+
+		for (int i = 0; i < PACKET; i++)
+		{
+			int k = i + PACKET * j;
+
+			if (i >= w)
+				p->rays[k] = row[w - 1];
+			p->ix[k] = (real)1.0 / p->rays[k].d.x;
+			p->iy[k] = (real)1.0 / p->rays[k].d.y;
+			p->iz[k] = (real)1.0 / p->rays[k].d.z;
+			p->t[k] = REAL_MAX;
+			p->objI[k] = -1;
+
+			if (i < w && j < h)
+				p->valid |= (uint64_t)1 << k;
+		}
+	}
+
+	// Every ray lies inside the cone spanned by the corner rays
+	Vec3 c[4] = {
+		p->rays[0].d, p->rays[w - 1].d,
+		p->rays[(w - 1) + PACKET * (h - 1)].d, p->rays[PACKET * (h - 1)].d
+	};
+	Vec3 mid = add(&c[0], &c[2]);
+
+	for (int k = 0; k < 4; k++)
+	{
+		p->side[k] = cross(&c[k], &c[(k + 1) % 4]);
+		if (dot(&p->side[k], &mid) < 0.0)
+			p->side[k] = scale(&p->side[k], -1.0);
+	}
+}
+
+// Frustum culling: the box is skipped when it lies entirely outside one of
+// the side planes. Degenerate (1 pixel wide) packets get zero normals and
+// never cull.
+static int outsideFrustum(const Packet *p, const Aabb *b)
+{
+	const Vec3 *o = &p->rays[0].o;
+
+	for (int k = 0; k < 4; k++)
+	{
+		const Vec3 *n = &p->side[k];
+		Vec3 pv = {
+			((n->x >= 0.0) ? b->hi.x : b->lo.x) - o->x,
+			((n->y >= 0.0) ? b->hi.y : b->lo.y) - o->y,
+			((n->z >= 0.0) ? b->hi.z : b->lo.z) - o->z
+		};
+		real slack = REAL_TOL * (fabs(n->x) + fabs(n->y) + fabs(n->z)) * (fabs(pv.x) + fabs(pv.y) + fabs(pv.z));
+
+		if (dot((Vec3 *)n, &pv) < -slack)
+			return 1;
+	}
+
+	return 0;
+}
+
+// Interval culling: no ray can enter the box before its distance from the origin
+static int beyondPacket(const Packet *p, const Aabb *b, real tMax)
+{
+	const Vec3 *o = &p->rays[0].o;
+	real gx = BVH_MAX(BVH_MAX(b->lo.x - o->x, o->x - b->hi.x), (real)0.0);
+	real gy = BVH_MAX(BVH_MAX(b->lo.y - o->y, o->y - b->hi.y), (real)0.0);
+	real gz = BVH_MAX(BVH_MAX(b->lo.z - o->z, o->z - b->hi.z), (real)0.0);
+
+	return sqrt(gx * gx + gy * gy + gz * gz) > tMax * (1 + REAL_TOL);
+}
+
+// Slab test for all rays of the packet at once, same arithmetic as hitAabb().
+// Cloned per instruction set so the loop vectorizes across rays.
+__attribute__((target_clones("avx512f", "avx2", "default")))
+static uint64_t boxMask(const Packet *p, const Aabb *b, uint64_t mask)
+{
+	const Vec3 *o = &p->rays[0].o;
+	real lx = b->lo.x - o->x, hx = b->hi.x - o->x;
+	real ly = b->lo.y - o->y, hy = b->hi.y - o->y;
+	real lz = b->lo.z - o->z, hz = b->hi.z - o->z;
+	unsigned char hit[PACKET_RAYS];
+
+	for (int i = 0; i < PACKET_RAYS; i++)
+	{
+		real tx0 = lx * p->ix[i], tx1 = hx * p->ix[i];
+		real ty0 = ly * p->iy[i], ty1 = hy * p->iy[i];
+		real tz0 = lz * p->iz[i], tz1 = hz * p->iz[i];
+
+		real tNear = BVH_MAX(BVH_MAX(BVH_MIN(tx0, tx1), BVH_MIN(ty0, ty1)), BVH_MAX(BVH_MIN(tz0, tz1), (real)0.0));
+		real tFar = BVH_MIN(BVH_MIN(BVH_MAX(tx0, tx1), BVH_MAX(ty0, ty1)), BVH_MIN(BVH_MAX(tz0, tz1), p->t[i]));
+
+		hit[i] = tNear <= tFar;
+	}
+
+	uint64_t out = 0;
+	for (int i = 0; i < PACKET_RAYS; i++)
+		out |= (uint64_t)hit[i] << i;
+
+	return out & mask;
+}
+
+static real packetMax(const Packet *p)
+{
+	real tMax = 0;
+
+	for (int i = 0; i < PACKET_RAYS; i++)
+		if ((p->valid >> i & 1) && p->t[i] > tMax)
+			tMax = p->t[i];
+
+	return tMax;
+}
+
+static void packetTree(Packet *p, Scene *sc, const Bvh *bvh)
+{
+	const Kernel *kern = sc->kern;
+	int tris = (bvh == &sc->triBvh);
+
+	// Children are ordered by the direction of the packet's middle ray
+	Vec3 *d = &p->rays[PACKET / 2 + PACKET * (PACKET / 2)].d;
+	int dirNeg[3] = {d->x < 0.0, d->y < 0.0, d->z < 0.0};
+
+	struct {
+		int node;
+		uint64_t mask;
+	} stack[BVH_STACK];
+	int sp = 0;
+	int node = 0;
+	uint64_t mask = p->valid;
+	real tMax = packetMax(p);
+
+	for (;;)
+	{
+		const BvhNode *n = &bvh->nodes[node];
+
+		STATS_ADD(STAT_NODES, 1);
+		if (!outsideFrustum(p, &n->box) && !beyondPacket(p, &n->box, tMax))
+			mask = boxMask(p, &n->box, mask);
+		else
+			mask = 0;
+
+		int active = __builtin_popcountll(mask);
+
+		if (active > 0 && n->count > 0)
+		{
+			STATS_ADD(STAT_TESTS, active * n->count);
+			for (uint64_t m = mask; m; m &= m - 1)
+			{
+				int k = __builtin_ctzll(m);
+				if (tris)
+					kern->hitTris(&sc->tris, n->first, n->count, &p->rays[k], &p->t[k], &p->objI[k], 0);
+				else
+					kern->hitSpheres(&sc->soa, n->first, n->count, &p->rays[k], &p->t[k], &p->objI[k], 0);
+			}
+			tMax = packetMax(p);
+		}
+		else if (active > 0 && active <= DIVERGED)
+		{
+			// Too few rays left to share the work, trace them separately
+			for (uint64_t m = mask; m; m &= m - 1)
+			{
+				int k = __builtin_ctzll(m);
+				rayHitNode(&p->rays[k], sc, bvh, node, &p->t[k], &p->objI[k], 0);
+			}
+			tMax = packetMax(p);
+		}
+		else if (active > 0)
+		{
+			int near = node + 1, far = n->first;
+			if (dirNeg[n->axis])
+			{
+				near = n->first;
+				far = node + 1;
+			}
+			stack[sp].node = far;
+			stack[sp++].mask = mask;
+			node = near;
+			continue;
+		}
+
+		if (sp == 0)
+			break;
+		sp--;
+		node = stack[sp].node;
+		mask = stack[sp].mask;
+	}
+}
+
+void packetHit(Packet *p, Scene *sc)
+{
+	STATS_ADD(STAT_TESTS, __builtin_popcountll(p->valid) * sc->soa.planesLen);
+	for (int k = 0; k < PACKET_RAYS; k++)
+		if (p->valid >> k & 1)
+			sc->kern->hitPlanes(&sc->soa, 0, sc->soa.planesLen, &p->rays[k], &p->t[k], &p->objI[k], 0);
+
+	if (sc->bvh.nodesLen > 0)
+		packetTree(p, sc, &sc->bvh);
+	if (sc->triBvh.nodesLen > 0)
+		packetTree(p, sc, &sc->triBvh);
+}
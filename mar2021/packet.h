@@ -0,0 +1,28 @@
+#ifndef PACKET_H
+#define PACKET_H
+#include <stdint.h>
+#include "parser.h"
+
+// Primary rays are traced in PACKET x PACKET blocks that share one origin
+enum { PACKET = 8, PACKET_RAYS = PACKET * PACKET };
+
+typedef struct Packet {
+	Ray rays[PACKET_RAYS];
+	real ix[PACKET_RAYS], iy[PACKET_RAYS], iz[PACKET_RAYS];
+	real t[PACKET_RAYS];
+	int objI[PACKET_RAYS];
+	// Bit i set when rays[i] is a real pixel (edge packets are partial)
+	uint64_t valid;
+	// Inward normals of the four side planes of the packet's frustum
+	Vec3 side[4];
+} Packet;
+
+// Builds the camera rays for pixels [x0, x0 + w) x [y0, y0 + h), w, h <= PACKET
+void packetInit(Packet *p, const Camera *cam, int x0, int y0, int w, int h);
+
+// Closest hit for every valid ray, results in p->t / p->objI. Identical to
+// calling rayHit() per ray; sub-trees only a few rays reach fall back to
+// single-ray traversal.
+void packetHit(Packet *p, Scene *sc);
+
+#endif
@@ -1,110 +1,498 @@
 #include "parser.h"
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
-Object parseObject(char *obj);
+// Read position in the mapped file, lines are parsed in place
+typedef struct Cursor {
+	const char *p;
+	const char *end;
+} Cursor;
 
-int getObjectCount(FILE *f);
+// Powers of ten that are exact in a double
+static const double POW10[23] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
 
-int parseScene(char *fileName, Scene *s)
+static void skipSpace(Cursor *c)
 {
-	FILE *f = fopen(fileName, "r");
+	while (c->p < c->end && (*c->p == ' ' || *c->p == '\t' || *c->p == '\r'))
+		c->p++;
+}
+
+static void skipLine(Cursor *c)
+{
+	const char *nl = memchr(c->p, '\n', c->end - c->p);
+	c->p = (nl != NULL) ? nl + 1 : c->end;
+}
+
+static int isDigit(char ch)
+{
+	return ch >= '0' && ch <= '9';
+}
+
+// Correctly rounded like strtod(). Up to 19 significant digits with a
+// small exponent are exact in one multiply or divide (Clinger's fast path),
+// anything else is handed to strtod().
+static int parseDouble(Cursor *c, double *out)
+{
+	skipSpace(c);
+
+	const char *p = c->p, *start = c->p;
+	int neg = 0;
+
+	if (p < c->end && (*p == '-' || *p == '+'))
+		neg = (*p++ == '-');
+
+	uint64_t m = 0;
+	int digits = 0, exp10 = 0, seen = 0;
+
+	for (; p < c->end && isDigit(*p); p++, seen = 1)
+	{
+		if (digits < 19)
+		{
+			m = m * 10 + (uint64_t)(*p - '0');
+			digits += (m != 0);
+		}
+		else
+		{
+			exp10++;
+			digits++;
+		}
+	}
+	if (p < c->end && *p == '.')
+	{
+		for (p++; p < c->end && isDigit(*p); p++, seen = 1)
+		{
+			if (digits < 19)
+			{
+				m = m * 10 + (uint64_t)(*p - '0');
+				digits += (m != 0);
+				exp10--;
+			}
+			else
+				digits++;
+		}
+	}
+	if (seen && p < c->end && (*p == 'e' || *p == 'E'))
+	{
+		const char *q = p + 1;
+		int eneg = 0, e = 0;
+
+		if (q < c->end && (*q == '-' || *q == '+'))
+			eneg = (*q++ == '-');
+		if (q < c->end && isDigit(*q))
+		{
+			for (; q < c->end && isDigit(*q); q++)
+				e = (e < 10000) ? e * 10 + (*q - '0') : e;
+			exp10 += eneg ? -e : e;
+			p = q;
+		}
+	}
+
+	if (seen && digits <= 19 && m <= ((uint64_t)1 << 53) && exp10 >= -22 && exp10 <= 22)
+	{
+		double v = (double)m;
+		v = (exp10 < 0) ? v / POW10[-exp10] : v * POW10[exp10];
+		*out = neg ? -v : v;
+		c->p = p;
+		return 1;
+	}
 
-	int objCount = getObjectCount(f);
+	// Long mantissas, big exponents, inf and nan
+	char buf[128];
+	size_t n = 0;
+	while (start + n < c->end && n < sizeof(buf) - 1 && start[n] != ',' && start[n] != '\n')
+	{
+		buf[n] = start[n];
+		n++;
+	}
+	buf[n] = '\0';
+
+	char *stop;
+	double v = strtod(buf, &stop);
+	if (stop == buf)
+		return 0;
+
+	*out = v;
+	c->p = start + (stop - buf);
+	return 1;
+}
+
+static int parseInt(Cursor *c, int *out)
+{
+	skipSpace(c);
+
+	const char *p = c->p;
+	int neg = 0;
+	long v = 0;
 
-	if (objCount > 0 && s != NULL)
+	if (p < c->end && (*p == '-' || *p == '+'))
+		neg = (*p++ == '-');
+	if (p == c->end || !isDigit(*p))
+		return 0;
+
+	for (; p < c->end && isDigit(*p); p++)
+		v = (v < 100000000) ? v * 10 + (*p - '0') : v;
+
+	*out = (int)(neg ? -v : v);
+	c->p = p;
+	return 1;
+}
+
+static int comma(Cursor *c)
+{
+	skipSpace(c);
+	if (c->p < c->end && *c->p == ',')
 	{
-		s->objs = malloc(sizeof(Object) * objCount);
-		s->objsLen = objCount;
+		c->p++;
+		return 1;
 	}
+	return 0;
+}
 
-	char token;
-	int objNum = 0;
+// Reads up to n comma separated numbers, stopping at the first one that
+// does not parse. Returns how many were read.
+static int parseDoubles(Cursor *c, double *v, int n)
+{
+	for (int i = 0; i < n; i++)
+		if ((i > 0 && !comma(c)) || !parseDouble(c, &v[i]))
+			return i;
+	return n;
+}
+
+static int isSpace(char ch)
+{
+	return ch == ' ' || ch == '\t' || ch == '\r';
+}
 
-	while ((token = (char)fgetc(f)) != EOF)
+// Maps a file read only, *size 0 gives NULL
+static const char *mapFile(const char *fileName, size_t *size)
+{
+	int fd = open(fileName, O_RDONLY);
+	struct stat st;
+
+	if (fd < 0 || fstat(fd, &st) < 0)
 	{
-		char line[255];
-		fgets(line, 255, f);
+		if (fd >= 0)
+			close(fd);
+		return MAP_FAILED;
+	}
+
+	*size = (size_t)st.st_size;
+	void *data = (*size > 0) ? mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+	close(fd);
+
+	// One front to back pass
+	if (*size > 0 && data != MAP_FAILED)
+		madvise(data, *size, MADV_SEQUENTIAL);
+
+	return data;
+}
+
+// Reads the v and f lines of a Wavefront OBJ file into m, placing vertex v
+// at o + scale * v. Polygons are split into fans, texture and normal
+// indices are skipped. A polygon with a missing vertex is dropped whole.
+// The file's size is added to *bytes.
+static int parseObjFile(const char *fileName, Mesh *m, Vec3 o, double scale, int obj, size_t *bytes)
+{
+	size_t size;
+	const char *data = mapFile(fileName, &size);
+
+	if (data == MAP_FAILED)
+		return 0;
+	*bytes += size;
+
+	Cursor c = {data, data + size};
+	int base = m->vertsLen, ok = 1;
+
+	while (ok && c.p < c.end)
+	{
+		skipSpace(&c);
+		if (c.end - c.p >= 2 && c.p[0] == 'v' && isSpace(c.p[1]))
+		{
+			double v[3] = {0.0};
+			c.p++;
+			for (int i = 0; i < 3 && parseDouble(&c, &v[i]); i++)
+				;
+			ok = meshAddVert(m, (Vec3) {o.x + scale * v[0], o.y + scale * v[1], o.z + scale * v[2]});
+		}
+		else if (c.end - c.p >= 2 && c.p[0] == 'f' && isSpace(c.p[1]))
+		{
+			// The fan is taken back if a later index turns out to be missing
+			int count = m->vertsLen - base, n = 0, idx, first = 0, prev = 0, faces = m->facesLen;
+			c.p++;
+			while (parseInt(&c, &idx))
+			{
+				// Skip /texture/normal
+				while (c.p < c.end && !isSpace(*c.p) && *c.p != '\n')
+					c.p++;
+
+				idx = (idx < 0) ? count + idx : idx - 1;
+				if (idx < 0 || idx >= count)
+				{
+					n = -1;
+					break;
+				}
+				idx += base;
+
+				if (n == 0)
+					first = idx;
+				else if (n >= 2)
+					ok = ok && meshAddFace(m, (Face) {{first, prev, idx}, obj});
+				prev = idx;
+				n++;
+			}
+			if (n < 0)
+			{
+				m->facesLen = faces;
+				printf("Warning: Face with a missing vertex in '%s'.\n", fileName);
+			}
+		}
+		skipLine(&c);
+	}
+
+	if (size > 0)
+		munmap((void *)data, size);
+
+	return ok;
+}
+
+static int parseObject(Cursor *c, Object *out, Scene *s, const char *dir, size_t *bytes)
+{
+	skipSpace(c);
+	char type = (c->p < c->end && *c->p != '\n') ? *c->p++ : ' ';
+	double v[9] = {0.0};
+
+	comma(c);
+
+	switch (type)
+	{
+		case 's':
+			parseDoubles(c, v, 7);
+			*out = (Object) {OBJ_SPHERE, {v[0], v[1], v[2]}, {.sp = {{v[3], v[4], v[5]}, v[6]}}};
+			return 1;
+		case 'p':
+			parseDoubles(c, v, 9);
+			*out = (Object) {OBJ_PLANE, {v[0], v[1], v[2]}, {.pl = {{v[3], v[4], v[5]}, {v[6], v[7], v[8]}}}};
+			return 1;
+		case 'm': ;
+			// m,r,g,b,x,y,z,scale,file.obj with the path relative to the scene
+			v[6] = 1.0;
+			parseDoubles(c, v, 7);
+			comma(c);
+			skipSpace(c);
+
+			const char *nl = memchr(c->p, '\n', c->end - c->p);
+			const char *end = (nl != NULL) ? nl : c->end;
+			while (end > c->p && isSpace(end[-1]))
+				end--;
+
+			char path[4096];
+			int dirLen = (c->p < end && *c->p == '/') ? 0 : (int)strlen(dir);
+			if (dirLen + (end - c->p) + 1 > (long)sizeof(path))
+				return 0;
+			memcpy(path, dir, dirLen);
+			memcpy(path + dirLen, c->p, end - c->p);
+			path[dirLen + (end - c->p)] = '\0';
+
+			int first = s->mesh.facesLen, verts = s->mesh.vertsLen;
+			if (!parseObjFile(path, &s->mesh, (Vec3) {v[3], v[4], v[5]}, v[6], s->objsLen, bytes))
+			{
+				printf("Error: Could not load mesh '%s'.\n", path);
+				s->mesh.facesLen = first;
+				s->mesh.vertsLen = verts;
+				return 0;
+			}
+			*out = (Object) {OBJ_MESH, {v[0], v[1], v[2]},
+							 {.ms = {{v[3], v[4], v[5]}, v[6], first, s->mesh.facesLen - first}}};
+			return 1;
+		default:
+			printf("Error: Object '%c' not recognized.\n", type);
+			return 0;
+	}
+}
+
+static int parseKey(Cursor *c, Key *k)
+{
+	double v[3] = {0.0};
+
+	skipSpace(c);
+	if (c->p < c->end && *c->p == 'l')
+	{
+		c->p++;
+		k->target = KEY_LIGHT;
+	}
+	else if (!parseInt(c, &k->target))
+		return 0;
+
+	if (!comma(c) || !parseInt(c, &k->frame) || !comma(c) || parseDoubles(c, v, 3) != 3)
+		return 0;
+
+	k->o = (Vec3) {v[0], v[1], v[2]};
+	return 1;
+}
+
+static int parseBuffer(const char *data, size_t size, Scene *s, const char *dir, size_t *bytes)
+{
+	Cursor c = {data, data + size};
+	int objCap = 0;
+
+	s->objs = NULL;
+	s->objsLen = 0;
+
+	while (c.p < c.end)
+	{
+		char token = *c.p++;
 
 		if (token >= 95 && token <= 122)
 		{
 			switch (token)
 			{
 				case 'o': ;
-					Object obj = parseObject(line);
-					if (s != NULL)
-						s->objs[objNum++] = obj;
+					Object obj;
+					if (!parseObject(&c, &obj, s, dir, bytes))
+						break;
+					if (s->objsLen == objCap)
+					{
+						objCap = (objCap > 0) ? objCap * 2 : 64;
+						Object *objs = realloc(s->objs, sizeof(Object) * objCap);
+						if (objs == NULL)
+							return 0;
+						s->objs = objs;
+					}
+					s->objs[s->objsLen++] = obj;
+					break;
+				case 'c': ;
+					// c x,y,z,lookX,lookY,lookZ, looking down -z without the target
+					double v[6] = {0.0};
+					int n = parseDoubles(&c, v, 6);
+					if (n < 3)
+					{
+						printf("Warning: Camera line needs 'c x,y,z[,lookX,lookY,lookZ]', ignored.\n");
+						break;
+					}
+					s->cam.o = (Vec3) {v[0], v[1], v[2]};
+					s->cam.at = (n < 6) ? (Vec3) {v[0], v[1], v[2] - 1.0} : (Vec3) {v[3], v[4], v[5]};
 					break;
 				case 'l': ;
-					Vec3 o = {0.0, 0.0, 0.0};
-					double i = 0.0;
-					sscanf(line, " %lf,%lf,%lf,%lf", &o.x, &o.y, &o.z, &i);
-					s->li = (Light){o, i};
+					double l[4] = {0.0};
+					parseDoubles(&c, l, 4);
+					s->li = (Light) {{l[0], l[1], l[2]}, l[3]};
 					break;
 				case 's':
-					sscanf(" %d,%d,%lf,%lf", &s->WIDTH, &s->HEIGHT, &s->FOV, &s->DARKEST);
-					printf("Wow: %d,%d,%f,%f", s->WIDTH, s->HEIGHT, s->FOV, s->DARKEST);
+					if (parseInt(&c, &s->WIDTH) && comma(&c) && parseInt(&c, &s->HEIGHT) && comma(&c) &&
+						parseDouble(&c, &s->FOV) && comma(&c))
+						parseDouble(&c, &s->DARKEST);
+					if (s->WIDTH <= 0 || s->HEIGHT <= 0 || s->WIDTH > SCENE_MAX_SIZE || s->HEIGHT > SCENE_MAX_SIZE ||
+						!(s->FOV > 0.0))
+					{
+						printf("Error: Scene size must be 1 to %d and field of view positive.\n", SCENE_MAX_SIZE);
+						return 0;
+					}
 					s->AsR = (double)s->WIDTH / (double)s->HEIGHT;
 					break;
+				case 'a':
+					if (parseInt(&c, &s->anim.frames) && comma(&c))
+						parseInt(&c, &s->anim.delay);
+					s->anim.frames = (s->anim.frames > 0) ? s->anim.frames : 1;
+					break;
+				case 'k': ;
+					// Targets are checked once all objects are known
+					Key k = {KEY_LIGHT, 0, {0.0, 0.0, 0.0}};
+					if (parseKey(&c, &k) && !animAdd(&s->anim, k))
+						return 0;
+					break;
 				default:
 					printf("Warning: Token '%c' not recognized.\n", token);
 					break;
 			}
 		}
+
+		if (token != '\n')
+			skipLine(&c);
 	}
 
-	fclose(f);
+	int keys = 0;
+	for (int i = 0; i < s->anim.keysLen; i++)
+	{
+		Key *k = &s->anim.keys[i];
+		if (k->target < KEY_LIGHT || k->target >= s->objsLen)
+			printf("Warning: Keyframe for missing object %d.\n", k->target);
+		else if (k->target != KEY_LIGHT && s->objs[k->target].type == OBJ_MESH)
+			printf("Warning: Mesh %d cannot be animated.\n", k->target);
+		else
+			s->anim.keys[keys++] = *k;
+	}
+	s->anim.keysLen = keys;
+	animSort(&s->anim);
+
+	cameraBuild(&s->cam, s->WIDTH, s->HEIGHT, s->FOV);
 
 	return 1;
 }
 
-Object parseObject(char *obj)
+int parseScene(char *fileName, Scene *s, double *mbs)
 {
-	char type;
-	sscanf(obj, " %c,", &type);
-	
-	Vec3 c = {0.0, 0.0, 0.0};
-	Vec3 o = {0.0, 0.0, 0.0};
-	Object out = {0, {}, {}};
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
 
-	switch (type)
+	size_t size;
+	const char *data = mapFile(fileName, &size);
+	if (data == MAP_FAILED)
+		return 0;
+
+	// Meshes are looked up next to the scene file
+	char dir[4096] = "";
+	const char *slash = strrchr(fileName, '/');
+	if (slash != NULL && slash - fileName + 2 <= (long)sizeof(dir))
 	{
-		case 's': ;
-			double r = 0.0;
-			sscanf(obj, " %c,%lf,%lf,%lf,%lf,%lf,%lf,%lf", &type, &c.x, &c.y, &c.z, &o.x, &o.y, &o.z, &r);
-			out.obj.sp = (Sphere) {o, r};
-			break;
-		case 'p': ;
-			Vec3 n = {0.0, 0.0, 0.0};
-			sscanf(obj, " %c,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf", &type, &c.x, &c.y, &c.z, &o.x, &o.y, &o.z, &n.x, &n.y, &n.z);
-			out.type = 1;
-			out.obj.pl = (Plane) {o, n};
-			break;
-		default:
-			printf("Error: Object '%c' not recognized.\n", type);
-			break;
+		memcpy(dir, fileName, slash - fileName + 1);
+		dir[slash - fileName + 1] = '\0';
 	}
 
-	out.color = c;
+	// Meshes count towards the speed, their parsing is part of the time
+	size_t bytes = size;
+	int ok = parseBuffer(data, size, s, dir, &bytes);
 
-	return out;
-}
+	if (size > 0)
+		munmap((void *)data, size);
 
-int getObjectCount(FILE *f)
-{
-	int count = 0;
-	char ch = (char)fgetc(f);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (mbs != NULL)
+	{
+		double secs = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) * 1e-9;
+		*mbs = (secs > 0.0) ? (double)bytes / secs * 1e-6 : 0.0;
+	}
 
-	if (ch == 'o')
-		count++;
+	return ok;
+}
 
-	while ((ch = (char)fgetc(f)) != EOF)
+void sceneFree(Scene *s)
+{
+	if (s->map != NULL)
 	{
-		if (ch == '\n' && (ch = (char)fgetc(f)) == 'o')
-			count++;
+		munmap(s->map, s->mapSize);
+		s->map = NULL;
+	}
+	else
+	{
+		soaFree(&s->soa);
+		bvhFree(&s->bvh);
+		free(s->objs);
+		animFree(&s->anim);
+		triSoaFree(&s->tris);
+		bvhFree(&s->triBvh);
+		meshFree(&s->mesh);
 	}
 
-	rewind(f);
-
-	return count;
+	s->objs = NULL;
+	s->objsLen = 0;
 }
@@ -0,0 +1,357 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// Render benchmark: writes a fixed set of scenes, runs every renderer of
+// the repository that is built on them and reports the median wall time,
+// primary rays per second and peak RSS of each as JSON. Given a previous
+// report it fails when a case got slower or bigger by more than a set
+// percentage.
+//
+// 'rbench [-n runs] [-j threads] [-t percent] [-b baseline.json] [-o out.json]'
+//
+// Renderers run as child processes in a scratch directory, so the images
+// they write never touch the tree. Times include start up, scene loading
+// and writing the image, as a user would see them.
+
+enum { MAX_CASES = 16, MAX_ARGS = 12, MAX_RUNS = 64 };
+
+typedef struct Case {
+	const char *name, *renderer;
+	char *argv[MAX_ARGS];
+	// Files the renderer opens relative to its working directory
+	const char *links[2][2];
+	int width, height, frames;
+	// Filled in by runCase()
+	double medianMs;
+	long rssKb;
+} Case;
+
+typedef struct Baseline {
+	char name[64];
+	double medianMs;
+	long rssKb;
+} Baseline;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// Park-Miller generator, so the scenes are the same with every libc
+static unsigned long seed = 1;
+
+static double rnd(double lo, double hi)
+{
+	seed = seed * 48271 % 2147483647;
+	return lo + (hi - lo) * ((double)seed / 2147483647.0);
+}
+
+static void randomSpheres(FILE *f, int n, double yLo, double yHi)
+{
+	for (int i = 0; i < n; i++)
+	{
+		double r = rnd(0.1, 0.5);
+		fprintf(f, "o s,%.2f,%.2f,%.2f,%.3f,%.3f,%.3f,%.3f\n", rnd(0.0, 1.0), rnd(0.0, 1.0), rnd(0.0, 1.0),
+				rnd(-30.0, 30.0), rnd(yLo, yHi) + r, rnd(-60.0, -10.0), r);
+	}
+}
+
+// The generated scenes, at 800x600 like the fixed-size renderers
+static int writeScenes(const char *dir)
+{
+	char path[4096];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/spheres.sc", dir);
+	if ((f = fopen(path, "w")) == NULL)
+		return 0;
+	seed = 1;
+	fprintf(f, "# 4000 random spheres\ns 800,600,1.5708,0.5\n");
+	randomSpheres(f, 4000, -15.0, 15.0);
+	fprintf(f, "l 0.0,20.0,0.0,900.0\n");
+	fclose(f);
+
+	snprintf(path, sizeof(path), "%s/planes.sc", dir);
+	if ((f = fopen(path, "w")) == NULL)
+		return 0;
+	seed = 2;
+	fprintf(f, "# 200 spheres on a floor between three walls\ns 800,600,1.5708,0.5\n"
+			"o p,0.5,0.7,0.5,0.0,-3.0,0.0,0.0,-1.0,0.0\n"
+			"o p,0.7,0.7,0.7,0.0,0.0,-65.0,0.0,0.0,-1.0\n"
+			"o p,0.7,0.5,0.5,-35.0,0.0,0.0,-1.0,0.0,0.0\n"
+			"o p,0.5,0.5,0.7,35.0,0.0,0.0,1.0,0.0,0.0\n");
+	randomSpheres(f, 200, -3.0, -3.0);
+	fprintf(f, "l 5.0,12.0,-20.0,600.0\n");
+	fclose(f);
+
+	return 1;
+}
+
+// Absolute path of file if it exists and can be run (or read when !exec)
+static char *found(const char *file, int exec)
+{
+	char *path = realpath(file, NULL);
+	if (path != NULL && access(path, exec ? X_OK : R_OK) != 0)
+	{
+		free(path);
+		path = NULL;
+	}
+	return path;
+}
+
+// Runs c once in dir, returns the wall time in seconds or -1 on failure
+static double runOnce(Case *c, const char *dir, long *rssKb)
+{
+	double start = now();
+	pid_t pid = fork();
+
+	if (pid == 0)
+	{
+		int null = open("/dev/null", O_WRONLY);
+		if (chdir(dir) != 0 || null < 0)
+			_exit(127);
+		dup2(null, STDOUT_FILENO);
+		dup2(null, STDERR_FILENO);
+		execv(c->argv[0], c->argv);
+		_exit(127);
+	}
+	if (pid < 0)
+		return -1.0;
+
+	int status;
+	struct rusage ru;
+	if (wait4(pid, &status, 0, &ru) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		return -1.0;
+
+	double secs = now() - start;
+	// Linux reports kilobytes
+	*rssKb = ru.ru_maxrss;
+	return secs;
+}
+
+static int cmpDouble(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+// One untimed run to warm the caches, then the median of runs
+static int runCase(Case *c, const char *root, int runs)
+{
+	char dir[2048];
+	double secs[MAX_RUNS];
+	long rss = 0;
+
+	snprintf(dir, sizeof(dir), "%s/%s", root, c->name);
+	if (mkdir(dir, 0700) != 0)
+		return 0;
+	for (int i = 0; i < 2 && c->links[i][0] != NULL; i++)
+	{
+		char link[4096];
+		snprintf(link, sizeof(link), "%s/%s", dir, c->links[i][0]);
+		if (symlink(c->links[i][1], link) != 0)
+			return 0;
+	}
+
+	c->rssKb = 0;
+	for (int i = -1; i < runs; i++)
+	{
+		double s = runOnce(c, dir, &rss);
+		if (s < 0.0)
+			return 0;
+		if (i >= 0)
+			secs[i] = s;
+		c->rssKb = (rss > c->rssKb) ? rss : c->rssKb;
+	}
+
+	qsort(secs, runs, sizeof(double), cmpDouble);
+	c->medianMs = 1e3 * ((runs & 1) ? secs[runs / 2] : 0.5 * (secs[runs / 2 - 1] + secs[runs / 2]));
+	return 1;
+}
+
+// Reads the cases of a report written by rbench, one per line
+static int readBaseline(const char *path, Baseline *out, int max)
+{
+	FILE *f = fopen(path, "r");
+	char line[1024];
+	int n = 0;
+
+	if (f == NULL)
+		return -1;
+
+	while (n < max && fgets(line, sizeof(line), f) != NULL)
+	{
+		char *name = strstr(line, "\"name\": \"");
+		char *ms = strstr(line, "\"median_ms\": ");
+		char *rss = strstr(line, "\"peak_rss_kb\": ");
+		if (name == NULL || ms == NULL || rss == NULL || sscanf(name + 9, "%63[^\"]", out[n].name) != 1)
+			continue;
+		out[n].medianMs = atof(ms + 13);
+		out[n].rssKb = atol(rss + 15);
+		n++;
+	}
+
+	fclose(f);
+	return n;
+}
+
+static void addCase(Case *cases, int *n, Case c)
+{
+	if (c.argv[0] != NULL && *n < MAX_CASES)
+		cases[(*n)++] = c;
+	else if (c.argv[0] == NULL)
+		fprintf(stderr, "Skipping %s: %s is not built\n", c.name, c.renderer);
+}
+
+int main(int argc, char *argv[])
+{
+	int runs = 5;
+	int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	double tolerance = 10.0;
+	const char *basePath = NULL, *outPath = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:j:n:o:t:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'b':
+				basePath = optarg;
+				break;
+			case 'j':
+				threads = atoi(optarg);
+				break;
+			case 'n':
+				runs = atoi(optarg);
+				break;
+			case 'o':
+				outPath = optarg;
+				break;
+			case 't':
+				tolerance = atof(optarg);
+				break;
+			default:
+				printf("Usage: 'rbench [-n runs] [-j threads] [-t percent] [-b baseline.json] [-o out.json]'\n");
+				return 1;
+		}
+	}
+	if (runs < 1 || runs > MAX_RUNS || threads < 1)
+	{
+		printf("Runs must be in [1, %d] and threads at least 1. Quitting...\n", MAX_RUNS);
+		return 1;
+	}
+
+	// Read before the report is opened, which may be the same file
+	Baseline base[MAX_CASES];
+	int baseLen = (basePath != NULL) ? readBaseline(basePath, base, MAX_CASES) : 0;
+	if (baseLen < 0)
+	{
+		printf("Could not read baseline '%s'. Quitting...\n", basePath);
+		return 1;
+	}
+
+	char root[] = "/tmp/rbench.XXXXXX";
+	if (mkdtemp(root) == NULL || !writeScenes(root))
+	{
+		printf("Could not write the scenes. Quitting...\n");
+		return 1;
+	}
+
+	char spheres[4096], planes[4096], jobs[16];
+	snprintf(spheres, sizeof(spheres), "%s/spheres.sc", root);
+	snprintf(planes, sizeof(planes), "%s/planes.sc", root);
+	snprintf(jobs, sizeof(jobs), "%d", threads);
+
+	char *rays = found("rays", 1);
+	char *teapot = found("teapot.sc", 0);
+	char *teapotObj = found("../dec2020/teapot.obj", 0);
+	char *bg = found("../nov2020/src", 0);
+
+	Case cases[MAX_CASES];
+	int n = 0;
+
+	addCase(cases, &n, (Case) {"spheres", "mar2021", {rays, "-j", jobs, spheres, "out.gif"}, {{NULL}}, 800, 600, 1, 0, 0});
+	addCase(cases, &n, (Case) {"planes", "mar2021", {rays, "-j", jobs, planes, "out.gif"}, {{NULL}}, 800, 600, 1, 0, 0});
+	if (teapot != NULL)
+		addCase(cases, &n, (Case) {"teapot", "mar2021", {rays, "-j", jobs, teapot, "out.gif"}, {{NULL}}, 800, 600, 1, 0, 0});
+	addCase(cases, &n, (Case) {"two_spheres", "jan2021", {found("../jan2021/rays", 1)}, {{NULL}}, 800, 600, 1, 0, 0});
+	if (bg != NULL)
+		addCase(cases, &n, (Case) {"background", "nov2020", {found("../nov2020/target/release/nov2020", 1)},
+								   {{"src", bg}}, 800, 600, 1, 0, 0});
+	if (teapotObj != NULL)
+		addCase(cases, &n, (Case) {"teapot_rust", "dec2020", {found("../dec2020/target/release/dec2020", 1)},
+								   {{"teapot.obj", teapotObj}}, 800, 600, 1, 0, 0});
+	addCase(cases, &n, (Case) {"sdf", "feb2021", {found("../feb2021/target/release/raymarcher", 1)}, {{NULL}}, 800, 600, 1, 0, 0});
+
+	FILE *out = (outPath != NULL) ? fopen(outPath, "w") : stdout;
+	if (out == NULL)
+	{
+		printf("Could not write '%s'. Quitting...\n", outPath);
+		return 1;
+	}
+
+	fprintf(out, "{\n  \"runs\": %d,\n  \"threads\": %d,\n  \"cases\": [\n", runs, threads);
+	int failed = 0, written = 0;
+	for (int i = 0; i < n; i++)
+	{
+		Case *c = &cases[i];
+		if (!runCase(c, root, runs))
+		{
+			fprintf(stderr, "%s (%s) failed to run\n", c->name, c->renderer);
+			failed = 1;
+			continue;
+		}
+
+		double mrays = (double)c->width * c->height * c->frames / (c->medianMs * 1e-3) * 1e-6;
+		fprintf(out, "%s    {\"name\": \"%s\", \"renderer\": \"%s\", \"width\": %d, \"height\": %d, \"frames\": %d, "
+				"\"median_ms\": %.2f, \"mrays_per_s\": %.2f, \"peak_rss_kb\": %ld}",
+				written++ ? ",\n" : "", c->name, c->renderer, c->width, c->height, c->frames, c->medianMs, mrays, c->rssKb);
+		fflush(out);
+	}
+	fprintf(out, "\n  ]\n}\n");
+	if (out != stdout)
+		fclose(out);
+
+	// Scratch files go, the renderers' outputs with them
+	char cmd[4200];
+	snprintf(cmd, sizeof(cmd), "rm -rf '%s'", root);
+	if (system(cmd) != 0)
+		fprintf(stderr, "Could not remove %s\n", root);
+
+	if (basePath == NULL)
+		return failed;
+
+	// Time and memory both count, either growing past the tolerance fails
+	for (int i = 0; i < n; i++)
+	{
+		for (int j = 0; j < baseLen; j++)
+		{
+			if (strcmp(cases[i].name, base[j].name) != 0 || cases[i].medianMs <= 0.0)
+				continue;
+			if (base[j].medianMs <= 0.0 || base[j].rssKb <= 0)
+			{
+				fprintf(stderr, "%-12s baseline has no time or memory, not compared\n", cases[i].name);
+				continue;
+			}
+
+			double dt = 100.0 * (cases[i].medianMs / base[j].medianMs - 1.0);
+			double dm = 100.0 * ((double)cases[i].rssKb / (double)base[j].rssKb - 1.0);
+			int bad = dt > tolerance || dm > tolerance;
+			fprintf(stderr, "%-12s %9.2f ms %+7.1f%%  %8ld kB %+7.1f%%%s\n", cases[i].name, cases[i].medianMs, dt,
+					cases[i].rssKb, dm, bad ? "  REGRESSION" : "");
+			failed |= bad;
+		}
+	}
+
+	return failed;
+}
@@ -0,0 +1,644 @@
+#include "render.h"
+#include "packet.h"
+#include "stats.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DBL_MAX 1.7976931348623158e+308
+
+const double ASR = (double)WIDTH/(double)HEIGHT;
+const double FOV = 1.5708;
+
+const double DARKEST = 0.5;
+
+typedef struct TileJob {
+	Scene **scs;
+	uint8_t **frames;
+	int cols;
+	int tiles;
+	// Frame * tiles + tile of every tile to trace
+	int *todo;
+} TileJob;
+
+// A pixel between its lighting and its shadow ray; shading is split in
+// these steps so a tile can run each over a whole packet or row
+typedef struct Shading {
+	Vec3 color;
+	double lInt;
+	Ray shadow;
+	real lightMag;
+	int hit, cast;
+} Shading;
+
+static void shadeLight(Scene *sc, Ray *r, real t, int objI, Shading *s)
+{
+	s->hit = objI >= 0;
+	s->cast = 0;
+	if (!s->hit)
+		return;
+	STATS_ADD(STAT_HITS, 1);
+
+	Vec3 rDist = scale(&r->d, t);
+	Vec3 hitP = add(&r->o, &rDist);
+
+	Vec3 newDir = sub(&sc->li.o, &hitP);
+	real lightMag = mag(&newDir);
+	newDir = norm(&newDir);
+	Vec3 objNorm;
+
+	if (objI < sc->objsLen)
+	{
+		objNorm = getNormal(&(sc->objs[objI]), &hitP);
+		s->color = sc->objs[objI].color;
+
+		// Plane normals point away from the rays that can hit them, light
+		// the side facing the ray like a triangle's
+		if (sc->objs[objI].type == OBJ_PLANE)
+			objNorm = scale(&objNorm, -1.0);
+	}
+	else
+	{
+		// Triangles are double sided, light the side facing the ray
+		int f = objI - sc->objsLen;
+		objNorm = meshNormal(&sc->mesh, f);
+		if (dot(&objNorm, &r->d) > 0.0)
+			objNorm = scale(&objNorm, -1.0);
+		s->color = sc->objs[sc->mesh.faces[f].obj].color;
+	}
+
+	s->lInt = dot(&objNorm, &newDir) * sc->li.r / pow(lightMag, 2.0);
+
+	// Points already at the darkest level look the same in shadow
+	if (s->lInt > sc->DARKEST)
+	{
+		Vec3 rayO = scale(&objNorm, 1e-4);
+		rayO = add(&rayO, &hitP);
+		s->shadow = (Ray) {rayO, newDir};
+		s->lightMag = lightMag;
+		s->cast = 1;
+	}
+}
+
+static void shadeShadow(Scene *sc, Shading *s, Occluder *occ)
+{
+	if (!s->cast)
+		return;
+
+	int blocked = occluded(&s->shadow, sc, s->lightMag, occ);
+	STATS_ADD(STAT_SHADOW, 1);
+	STATS_ADD(STAT_OCCLUDED, blocked);
+	if (blocked)
+		s->lInt = sc->DARKEST;
+}
+
+static uint8_t shadeQuantize(Scene *sc, Shading *s)
+{
+	if (!s->hit)
+		return 0;
+
+	double lInt = (s->lInt >= sc->DARKEST) ? s->lInt : sc->DARKEST;
+	lInt = (lInt > 1) ? 1 : lInt;
+	Vec3 col = scale(&s->color, lInt);
+	return getNearestSafeColor(&col, NULL);
+}
+
+// Traces tile task % job->tiles of frame task / job->tiles
+static void traceTile(TileJob *job, int task)
+{
+	Scene *sc = job->scs[task / job->tiles];
+	uint8_t *frame = job->frames[task / job->tiles];
+
+	task %= job->tiles;
+	int x0 = (task % job->cols) * TILE;
+	int y0 = (task / job->cols) * TILE;
+	int x1 = (x0 + TILE < sc->WIDTH) ? x0 + TILE : sc->WIDTH;
+	int y1 = (y0 + TILE < sc->HEIGHT) ? y0 + TILE : sc->HEIGHT;
+
+	// A task runs on one thread start to end, so the shadow cache can live here
+	Occluder occ = {NULL, 0};
+
+	// Tiles never overlap, so workers can write to the frame without locking.
+	// Each phase runs over a whole row or packet before the next starts,
+	// which keeps the stats timers out of the per-pixel work.
+	// Holds a packet, or a row of a tile since TILE <= PACKET_RAYS
+	Shading sh[PACKET_RAYS];
+	if (!sc->packets)
+	{
+		Ray rays[TILE];
+		real t[TILE];
+		int objI[TILE];
+		int w = x1 - x0;
+
+		for (int y = y0; y < y1; y++)
+		{
+			uint8_t *row = &frame[x0 + (sc->WIDTH * y)];
+
+			STATS_BEGIN(gen);
+			cameraRow(&sc->cam, x0, y, w, rays);
+			STATS_END(PHASE_RAYGEN, gen);
+			STATS_BEGIN(hit);
+			for (int x = 0; x < w; x++)
+			{
+				t[x] = 0;
+				objI[x] = rayHit(&rays[x], sc, &t[x]);
+			}
+			STATS_END(PHASE_TRAVERSE, hit);
+
+			STATS_BEGIN(shade);
+			for (int x = 0; x < w; x++)
+				shadeLight(sc, &rays[x], t[x], objI[x], &sh[x]);
+			STATS_END(PHASE_SHADE, shade);
+			STATS_BEGIN(shadow);
+			for (int x = 0; x < w; x++)
+				shadeShadow(sc, &sh[x], &occ);
+			STATS_END(PHASE_SHADOW, shadow);
+			STATS_BEGIN(quantize);
+			for (int x = 0; x < w; x++)
+				row[x] = shadeQuantize(sc, &sh[x]);
+			STATS_END(PHASE_QUANTIZE, quantize);
+		}
+		return;
+	}
+
+	Packet p;
+	for (int py = y0; py < y1; py += PACKET)
+	{
+		for (int px = x0; px < x1; px += PACKET)
+		{
+			int w = (px + PACKET < x1) ? PACKET : x1 - px;
+			int h = (py + PACKET < y1) ? PACKET : y1 - py;
+
+			STATS_BEGIN(gen);
+			packetInit(&p, &sc->cam, px, py, w, h);
+			STATS_END(PHASE_RAYGEN, gen);
+			STATS_BEGIN(hit);
+			packetHit(&p, sc);
+			STATS_END(PHASE_TRAVERSE, hit);
+
+			// Pixels keep their row-major order in every phase, so the
+			// shadow cache sees the same sequence as shading one by one
+			STATS_BEGIN(shade);
+			for (int y = 0; y < h; y++)
+				for (int x = 0; x < w; x++)
+				{
+					int k = x + PACKET * y;
+					shadeLight(sc, &p.rays[k], p.t[k], p.objI[k], &sh[k]);
+				}
+			STATS_END(PHASE_SHADE, shade);
+			STATS_BEGIN(shadow);
+			for (int y = 0; y < h; y++)
+				for (int x = 0; x < w; x++)
+					shadeShadow(sc, &sh[x + PACKET * y], &occ);
+			STATS_END(PHASE_SHADOW, shadow);
+			STATS_BEGIN(quantize);
+			for (int y = 0; y < h; y++)
+				for (int x = 0; x < w; x++)
+					frame[(px + x) + (sc->WIDTH * (py + y))] = shadeQuantize(sc, &sh[x + PACKET * y]);
+			STATS_END(PHASE_QUANTIZE, quantize);
+		}
+	}
+}
+
+static void renderTile(void *ctx, int task, int worker)
+{
+	TileJob *job = ctx;
+	(void)worker;
+
+	TRACE_BEGIN(start);
+	traceTile(job, job->todo[task]);
+	TRACE_END(start, "tile", "frame_tile", job->todo[task]);
+}
+
+void renderFrame(Scene *sc, uint8_t *frame, Sched *pool)
+{
+	renderFrames(&sc, &frame, NULL, 1, pool);
+}
+
+int renderFrames(Scene **scs, uint8_t **frames, uint8_t **dirty, int n, Sched *pool)
+{
+	int cols = (scs[0]->WIDTH + TILE - 1) / TILE;
+	int rows = (scs[0]->HEIGHT + TILE - 1) / TILE;
+	int *todo = malloc(sizeof(int) * n * cols * rows);
+	int count = 0;
+
+	if (todo == NULL)
+		return -1;
+
+	for (int f = 0; f < n; f++)
+		for (int i = 0; i < cols * rows; i++)
+			if (dirty == NULL || dirty[f] == NULL || dirty[f][i])
+				todo[count++] = f * cols * rows + i;
+
+	TileJob job = {scs, frames, cols, cols * rows, todo};
+	if (count > 0)
+		schedRun(pool, count, renderTile, &job);
+	free(todo);
+
+	return count;
+}
+
+typedef struct SparseJob {
+	Scene *sc;
+	uint8_t *frame;
+	int cols;
+	int step;
+	int skip;
+} SparseJob;
+
+static void traceSparse(void *ctx, int task, int worker)
+{
+	SparseJob *job = ctx;
+	Scene *sc = job->sc;
+	Occluder occ = {NULL, 0};
+	(void)worker;
+
+	int x0 = (task % job->cols) * TILE;
+	int y0 = (task / job->cols) * TILE;
+	int x1 = (x0 + TILE < sc->WIDTH) ? x0 + TILE : sc->WIDTH;
+	int y1 = (y0 + TILE < sc->HEIGHT) ? y0 + TILE : sc->HEIGHT;
+
+	// Tiles start on the grid because step divides TILE
+	TRACE_BEGIN(start);
+	for (int y = y0; y < y1; y += job->step)
+		for (int x = x0; x < x1; x += job->step)
+			if (job->skip == 0 || x % job->skip != 0 || y % job->skip != 0)
+				job->frame[x + (sc->WIDTH * y)] = tracePixel(sc, x, y, &occ);
+	TRACE_END(start, "sparse tile", "step", job->step);
+}
+
+// Palette indices from getNearestSafeColor() as levels 0-5 of the colour
+// cube; index 0 is the black background
+static void cubeLevels(uint8_t i, int *l)
+{
+	i = (i < 16) ? 0 : i - 16;
+	l[0] = i / 36;
+	l[1] = (i / 6) % 6;
+	l[2] = i % 6;
+}
+
+static void fillSparse(void *ctx, int task, int worker)
+{
+	SparseJob *job = ctx;
+	int w = job->sc->WIDTH, h = job->sc->HEIGHT, s = job->step;
+	// step divides TILE, so it is a power of two
+	int shift = 2 * __builtin_ctz(s);
+	uint8_t *frame = job->frame;
+	(void)worker;
+
+	int x0 = (task % job->cols) * TILE;
+	int y0 = (task / job->cols) * TILE;
+	int x1 = (x0 + TILE < w) ? x0 + TILE : w;
+	int y1 = (y0 + TILE < h) ? y0 + TILE : h;
+
+	// One grid cell at a time; past the last grid row or column the edge
+	// samples are held
+	for (int gy0 = y0; gy0 < y1; gy0 += s)
+	{
+		int gy1 = (gy0 + s < h) ? gy0 + s : gy0;
+		int cy1 = (gy0 + s < y1) ? gy0 + s : y1;
+
+		for (int gx0 = x0; gx0 < x1; gx0 += s)
+		{
+			int gx1 = (gx0 + s < w) ? gx0 + s : gx0;
+			int cx1 = (gx0 + s < x1) ? gx0 + s : x1;
+			int c00[3], c10[3], c01[3], c11[3];
+
+			cubeLevels(frame[gx0 + w * gy0], c00);
+			cubeLevels(frame[gx1 + w * gy0], c10);
+			cubeLevels(frame[gx0 + w * gy1], c01);
+			cubeLevels(frame[gx1 + w * gy1], c11);
+
+			for (int y = gy0; y < cy1; y++)
+			{
+				int wy = (gy1 > gy0) ? y - gy0 : 0;
+
+				for (int x = gx0 + (y == gy0); x < cx1; x++)
+				{
+					int wx = (gx1 > gx0) ? x - gx0 : 0;
+					int l[3];
+
+					for (int c = 0; c < 3; c++)
+					{
+						int sum = c00[c] * (s - wx) * (s - wy) + c10[c] * wx * (s - wy) +
+								  c01[c] * (s - wx) * wy + c11[c] * wx * wy;
+						l[c] = (sum + (1 << shift >> 1)) >> shift;
+					}
+
+					int black = (l[0] | l[1] | l[2]) == 0;
+					frame[x + w * y] = black ? 0 : (uint8_t)(l[2] + l[1] * 6 + l[0] * 36 + 16);
+				}
+			}
+		}
+	}
+}
+
+void renderSparse(Scene *sc, uint8_t *frame, int step, int skip, Sched *pool)
+{
+	int cols = (sc->WIDTH + TILE - 1) / TILE;
+	int rows = (sc->HEIGHT + TILE - 1) / TILE;
+	SparseJob job = {sc, frame, cols, step, skip};
+
+	schedRun(pool, cols * rows, traceSparse, &job);
+	// Interpolation reads the grid of neighbouring tiles, so it waits for all
+	// of them. At step 1 there are no gaps left.
+	if (step > 1)
+		schedRun(pool, cols * rows, fillSparse, &job);
+}
+
+void renderCopyClean(const uint8_t *prev, uint8_t *frame, const uint8_t *dirty, int width, int height)
+{
+	int cols = (width + TILE - 1) / TILE;
+
+	for (int y = 0; y < height; y++)
+	{
+		const uint8_t *d = &dirty[(y / TILE) * cols];
+
+		for (int tx = 0; tx < cols; tx++)
+		{
+			if (d[tx])
+				continue;
+
+			// Copy the whole run of clean tiles on this row at once
+			int end = tx;
+			while (end < cols && !d[end])
+				end++;
+
+			int x0 = tx * TILE;
+			int x1 = (end * TILE < width) ? end * TILE : width;
+			memcpy(&frame[x0 + width * y], &prev[x0 + width * y], x1 - x0);
+			tx = end;
+		}
+	}
+}
+
+// Screen rectangle {lx, ly, hx, hy} grown to cover the projection of p,
+// see cameraProject()
+static int growRect(double *rect, const Camera *cam, Vec3 p, int dir)
+{
+	double x, y;
+
+	if (!cameraProject(cam, p, dir, &x, &y))
+		return 0;
+	rect[0] = (x < rect[0]) ? x : rect[0];
+	rect[1] = (y < rect[1]) ? y : rect[1];
+	rect[2] = (x > rect[2]) ? x : rect[2];
+	rect[3] = (y > rect[3]) ? y : rect[3];
+
+	return 1;
+}
+
+static void markRect(double *rect, uint8_t *dirty, int width, int height)
+{
+	// One pixel of slack for rounding in the projection
+	double lx = BVH_MAX(floor(rect[0]) - 1.0, 0.0);
+	double ly = BVH_MAX(floor(rect[1]) - 1.0, 0.0);
+	double hx = BVH_MIN(ceil(rect[2]) + 1.0, (double)(width - 1));
+	double hy = BVH_MIN(ceil(rect[3]) + 1.0, (double)(height - 1));
+	if (lx > hx || ly > hy)
+		return;
+
+	int x0 = (int)lx, x1 = (int)hx, y0 = (int)ly, y1 = (int)hy;
+	int cols = (width + TILE - 1) / TILE;
+
+	for (int ty = y0 / TILE; ty <= y1 / TILE; ty++)
+		for (int tx = x0 / TILE; tx <= x1 / TILE; tx++)
+			dirty[tx + cols * ty] = 1;
+}
+
+// Marks the tiles whose pixel centres can see the sphere or the shadow it
+// casts from the light at li. The eight corners of its bounding box
+// project to a convex hull around its silhouette. The shadow lies in the
+// box swept away from the light, whose far end projects to the vanishing
+// points of the directions from li through the corners.
+static int markSphere(const Sphere *sp, Vec3 li, const Camera *cam, uint8_t *dirty, int width, int height)
+{
+	double rect[4] = {DBL_MAX, DBL_MAX, -DBL_MAX, -DBL_MAX};
+	double r = fabs(sp->r);
+
+	for (int c = 0; c < 8; c++)
+	{
+		Vec3 p = {
+			sp->o.x + ((c & 1) ? r : -r),
+			sp->o.y + ((c & 2) ? r : -r),
+			sp->o.z + ((c & 4) ? r : -r)
+		};
+
+		// Directions towards the camera fail, the shadow could reach behind it
+		if (!growRect(rect, cam, p, 0) || !growRect(rect, cam, sub(&p, &li), 1))
+			return 0;
+	}
+
+	markRect(rect, dirty, width, height);
+	return 1;
+}
+
+int renderDirty(const Scene *base, int frame, uint8_t *dirty)
+{
+	const Anim *anim = &base->anim;
+	int cols = (base->WIDTH + TILE - 1) / TILE;
+	int rows = (base->HEIGHT + TILE - 1) / TILE;
+
+	memset(dirty, 0, cols * rows);
+
+	if (frame == 0)
+		goto full;
+
+	// Moving the light changes the shading of everything it reaches
+	Vec3 l0 = animAt(anim, KEY_LIGHT, frame - 1, base->li.o);
+	Vec3 l1 = animAt(anim, KEY_LIGHT, frame, base->li.o);
+	if (memcmp(&l0, &l1, sizeof(Vec3)) != 0)
+		goto full;
+
+	for (int i = 0; i < base->objsLen; i++)
+	{
+		Sphere was = base->objs[i].obj.sp, is = was;
+		was.o = animAt(anim, i, frame - 1, was.o);
+		is.o = animAt(anim, i, frame, is.o);
+
+		if (memcmp(&was.o, &is.o, sizeof(Vec3)) == 0)
+			continue;
+
+		// A plane spans the whole view, so do spheres or shadows reaching
+		// behind the camera
+		if (base->objs[i].type != OBJ_SPHERE ||
+			!markSphere(&was, l1, &base->cam, dirty, base->WIDTH, base->HEIGHT) ||
+			!markSphere(&is, l1, &base->cam, dirty, base->WIDTH, base->HEIGHT))
+			goto full;
+	}
+
+	return 1;
+
+full:
+	memset(dirty, 1, cols * rows);
+	return 0;
+}
+
+uint8_t tracePixel(Scene *sc, int x, int y, Occluder *occ)
+{
+	STATS_BEGIN(gen);
+	Ray r = cameraRay(&sc->cam, x, y);
+	STATS_END(PHASE_RAYGEN, gen);
+
+	real t = 0;
+	STATS_BEGIN(hit);
+	int objI = rayHit(&r, sc, &t);
+	STATS_END(PHASE_TRAVERSE, hit);
+
+	Shading sh;
+	STATS_BEGIN(shade);
+	shadeLight(sc, &r, t, objI, &sh);
+	STATS_END(PHASE_SHADE, shade);
+	STATS_BEGIN(shadow);
+	shadeShadow(sc, &sh, occ);
+	STATS_END(PHASE_SHADOW, shadow);
+	STATS_BEGIN(quantize);
+	uint8_t out = shadeQuantize(sc, &sh);
+	STATS_END(PHASE_QUANTIZE, quantize);
+	return out;
+}
+
+uint8_t shadePixel(Scene *sc, Ray *r, real t, int objI, Occluder *occ)
+{
+	Shading s;
+
+	shadeLight(sc, r, t, objI, &s);
+	shadeShadow(sc, &s, occ);
+	return shadeQuantize(sc, &s);
+}
+
+int rayHit(Ray *r, Scene *sc, real *t)
+{
+	real big = REAL_MAX;
+	int objI = -1;
+
+	// Planes are unbounded and stay out of the tree
+	STATS_ADD(STAT_TESTS, sc->soa.planesLen);
+	sc->kern->hitPlanes(&sc->soa, 0, sc->soa.planesLen, r, &big, &objI, 0);
+
+	if (sc->bvh.nodesLen > 0)
+		rayHitNode(r, sc, &sc->bvh, 0, &big, &objI, 0);
+
+	if (sc->triBvh.nodesLen > 0)
+		rayHitNode(r, sc, &sc->triBvh, 0, &big, &objI, 0);
+
+	*t = big;
+	return objI;
+}
+
+static int hitLeaf(Ray *r, Scene *sc, const Bvh *bvh, int node, real *t, int *objI, int once)
+{
+	const BvhNode *n = &bvh->nodes[node];
+
+	STATS_ADD(STAT_TESTS, n->count);
+	if (bvh == &sc->triBvh)
+		return sc->kern->hitTris(&sc->tris, n->first, n->count, r, t, objI, once);
+	return sc->kern->hitSpheres(&sc->soa, n->first, n->count, r, t, objI, once);
+}
+
+int occluded(Ray *r, Scene *sc, real tMax, Occluder *occ)
+{
+	// Hits have to be closer than tMax, so start the search there
+	real t = tMax;
+	int objI = -1;
+
+	if (occ->bvh != NULL && hitLeaf(r, sc, occ->bvh, occ->node, &t, &objI, 1))
+		return 1;
+
+	STATS_ADD(STAT_TESTS, sc->soa.planesLen);
+	if (sc->kern->hitPlanes(&sc->soa, 0, sc->soa.planesLen, r, &t, &objI, 1))
+		return 1;
+
+	const Bvh *trees[2] = {&sc->bvh, &sc->triBvh};
+	for (int i = 0; i < 2; i++)
+	{
+		if (trees[i]->nodesLen == 0)
+			continue;
+
+		int leaf = rayHitNode(r, sc, trees[i], 0, &t, &objI, 1);
+		if (leaf >= 0)
+		{
+			occ->bvh = trees[i];
+			occ->node = leaf;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int rayHitNode(Ray *r, Scene *sc, const Bvh *bvh, int node, real *t, int *objI, int once)
+{
+	Vec3 inv = {(real)1.0 / r->d.x, (real)1.0 / r->d.y, (real)1.0 / r->d.z};
+	int dirNeg[3] = {r->d.x < 0.0, r->d.y < 0.0, r->d.z < 0.0};
+	int stack[BVH_STACK];
+	int sp = 0;
+
+	for (;;)
+	{
+		BvhNode *n = &bvh->nodes[node];
+
+		STATS_ADD(STAT_NODES, 1);
+		if (hitAabb(&n->box, r, &inv, *t) >= 0.0)
+		{
+			if (n->count > 0)
+			{
+				if (hitLeaf(r, sc, bvh, node, t, objI, once) && once)
+					return node;
+			}
+			else
+			{
+				// Visit the child on the ray's side of the split first
+				int near = node + 1, far = n->first;
+				if (dirNeg[n->axis])
+				{
+					near = n->first;
+					far = node + 1;
+				}
+				stack[sp++] = far;
+				node = near;
+				continue;
+			}
+		}
+
+		if (sp == 0)
+			return -1;
+		node = stack[--sp];
+	}
+}
+
+Vec3 getNormal(Object *obj, Vec3 *hitP)
+{
+	Vec3 out = {0.0, 0.0, 0.0};
+
+	switch (obj->type)
+	{
+		// Sphere Normal
+		case OBJ_SPHERE:
+			out = sub(hitP, &(obj->obj.sp.o));
+			out = norm(&out);
+			break;
+		// Plane normal
+		case OBJ_PLANE:
+			out = obj->obj.pl.n;
+			break;
+		default:
+			break;
+	}
+
+	return out;
+}
+
+uint8_t getNearestSafeColor(Vec3 *c, Vec3 *err)
+{
+	uint8_t r = (uint8_t)(round(c->x * 5) * 51);
+	uint8_t g = (uint8_t)(round(c->y * 5) * 51);
+	uint8_t b = (uint8_t)(round(c->z * 5) * 51);
+	
+	Vec3 newCol = {(float)r, (float)g, (float)b};
+	if (err != NULL)
+		*err = sub(c, &newCol);
+
+	return (((uint8_t)newCol.z/0x33) + ((uint8_t)newCol.y/0x33)*6 + ((uint8_t)newCol.x/0x33)*36 + 16) % 256;
+}
@@ -0,0 +1,67 @@
+#ifndef RENDER_H
+#define RENDER_H
+#include <stdint.h>
+#include "parser.h"
+#include "sched.h"
+
+// Defaults for scenes without an 's' line
+enum { WIDTH = 800, HEIGHT = 600 };
+extern const double ASR;
+extern const double FOV;
+extern const double DARKEST;
+
+// Side length in pixels of the square tiles handed out to the workers
+enum { TILE = 16 };
+
+// Shadow ray cache: the leaf of sc->bvh or sc->triBvh that blocked the
+// last shadow ray, tested first since neighbouring pixels are usually
+// shadowed by the same object. Each thread keeps its own; bvh is NULL
+// when it holds nothing.
+typedef struct Occluder {
+	const Bvh *bvh;
+	int node;
+} Occluder;
+
+// Closest hit through sc->bvh. Returns the object index or -1.
+int rayHit(Ray *r, Scene *sc, real *t);
+
+// 1 when anything lies on r closer than tMax. Stops at the first such
+// hit, occ is tried first and updated with the leaf that blocked r.
+int occluded(Ray *r, Scene *sc, real tMax, Occluder *occ);
+
+// Walks the sub-tree under node of bvh (sc->bvh or sc->triBvh), keeping
+// *t / *objI as the closest hit so far. When once is set it stops at the
+// first hit closer than *t and returns its leaf node, otherwise -1.
+int rayHitNode(Ray *r, Scene *sc, const Bvh *bvh, int node, real *t, int *objI, int once);
+
+Vec3 getNormal(Object *obj, Vec3 *hitP);
+
+uint8_t tracePixel(Scene *sc, int x, int y, Occluder *occ);
+uint8_t shadePixel(Scene *sc, Ray *r, real t, int objI, Occluder *occ);
+
+// Traces every pixel of sc into frame (sc->WIDTH * sc->HEIGHT palette indices)
+void renderFrame(Scene *sc, uint8_t *frame, Sched *pool);
+
+// Renders scs[i] into frames[i] for i in [0, n). The tiles of all frames
+// share one pool run, so frames are traced in parallel. All scenes must
+// have the same size. With dirty, only the tiles set in dirty[i] are traced.
+// Returns the number of tiles traced, -1 when out of memory.
+int renderFrames(Scene **scs, uint8_t **frames, uint8_t **dirty, int n, Sched *pool);
+
+// One progressive pass: traces the pixels of sc on every step-th row and
+// column that are not on the grid of skip (0 traces all of them), then
+// fills the pixels in between by interpolating the grid. step must divide
+// TILE; skip is the previous pass's step, whose samples are kept.
+void renderSparse(Scene *sc, uint8_t *frame, int step, int skip, Sched *pool);
+
+// Fills the tiles of base's animation that frame can change relative to
+// frame - 1, one byte per TILE x TILE tile in row order. Returns 0 when
+// the whole frame has to be traced.
+int renderDirty(const Scene *base, int frame, uint8_t *dirty);
+
+// Copies the tiles not set in dirty from prev into frame
+void renderCopyClean(const uint8_t *prev, uint8_t *frame, const uint8_t *dirty, int width, int height);
+
+uint8_t getNearestSafeColor(Vec3 *c, Vec3 *err);
+
+#endif
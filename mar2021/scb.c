@@ -0,0 +1,304 @@
+#include "scb.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char MAGIC[8] = "RAYSSCB";
+
+// Byte order and struct sizes guard against files from other machines
+typedef struct ScbHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t order;
+	uint32_t objectSize, nodeSize, keySize, faceSize;
+
+	int32_t width, height;
+	double asr, fov, darkest;
+	Light li;
+	Camera cam;
+	int32_t frames, delay;
+
+	int32_t objsLen, nodesLen, primsLen, planesLen, keysLen;
+	int32_t vertsLen, facesLen, triNodesLen;
+
+	// File offsets, all multiples of 64. Triangle prims are facesLen long.
+	uint64_t objs, nodes, prims, planes, soa, keys;
+	uint64_t verts, faces, triNodes, triPrims, tris, end;
+} ScbHeader;
+
+static uint64_t align64(uint64_t n)
+{
+	return (n + 63) / 64 * 64;
+}
+
+static int putSection(FILE *f, uint64_t *at, const void *data, size_t size)
+{
+	static const char zeros[64];
+	uint64_t pad = align64(*at) - *at;
+
+	if (fwrite(zeros, 1, pad, f) != pad || (size > 0 && fwrite(data, 1, size, f) != size))
+		return 0;
+
+	*at += pad + size;
+	return 1;
+}
+
+int scbWrite(const char *fileName, const Scene *sc)
+{
+	FILE *f = fopen(fileName, "wb");
+	if (f == NULL)
+		return 0;
+
+	const Bvh *bvh = &sc->bvh;
+	ScbHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, MAGIC, sizeof(MAGIC));
+	h.version = SCB_VERSION;
+	h.order = 0x01020304;
+	h.objectSize = sizeof(Object);
+	h.nodeSize = sizeof(BvhNode);
+	h.keySize = sizeof(Key);
+	h.faceSize = sizeof(Face);
+
+	h.width = sc->WIDTH;
+	h.height = sc->HEIGHT;
+	h.asr = sc->AsR;
+	h.fov = sc->FOV;
+	h.darkest = sc->DARKEST;
+	h.li = sc->li;
+	h.cam = sc->cam;
+	h.frames = sc->anim.frames;
+	h.delay = sc->anim.delay;
+
+	h.objsLen = sc->objsLen;
+	h.nodesLen = bvh->nodesLen;
+	h.primsLen = bvh->primsLen;
+	h.planesLen = bvh->planesLen;
+	h.keysLen = sc->anim.keysLen;
+	h.vertsLen = sc->mesh.vertsLen;
+	h.facesLen = sc->mesh.facesLen;
+	h.triNodesLen = sc->triBvh.nodesLen;
+
+	size_t soaBytes = soaSize(bvh->primsLen, bvh->planesLen);
+	size_t triBytes = triSoaSize(h.facesLen);
+	h.objs = align64(sizeof(h));
+	h.nodes = align64(h.objs + sizeof(Object) * h.objsLen);
+	h.prims = align64(h.nodes + sizeof(BvhNode) * h.nodesLen);
+	h.planes = align64(h.prims + sizeof(int) * h.primsLen);
+	h.soa = align64(h.planes + sizeof(int) * h.planesLen);
+	h.keys = align64(h.soa + soaBytes);
+	h.verts = align64(h.keys + sizeof(Key) * h.keysLen);
+	h.faces = align64(h.verts + sizeof(Vec3) * h.vertsLen);
+	h.triNodes = align64(h.faces + sizeof(Face) * h.facesLen);
+	h.triPrims = align64(h.triNodes + sizeof(BvhNode) * h.triNodesLen);
+	h.tris = align64(h.triPrims + sizeof(int) * h.facesLen);
+	h.end = h.tris + triBytes;
+
+	uint64_t at = 0;
+	int ok = putSection(f, &at, &h, sizeof(h)) &&
+			 putSection(f, &at, sc->objs, sizeof(Object) * h.objsLen) &&
+			 putSection(f, &at, bvh->nodes, sizeof(BvhNode) * h.nodesLen) &&
+			 putSection(f, &at, bvh->prims, sizeof(int) * h.primsLen) &&
+			 putSection(f, &at, bvh->planes, sizeof(int) * h.planesLen) &&
+			 putSection(f, &at, sc->soa.mem, soaBytes) &&
+			 putSection(f, &at, sc->anim.keys, sizeof(Key) * h.keysLen) &&
+			 putSection(f, &at, sc->mesh.verts, sizeof(Vec3) * h.vertsLen) &&
+			 putSection(f, &at, sc->mesh.faces, sizeof(Face) * h.facesLen) &&
+			 putSection(f, &at, sc->triBvh.nodes, sizeof(BvhNode) * h.triNodesLen) &&
+			 putSection(f, &at, sc->triBvh.prims, sizeof(int) * h.facesLen) &&
+			 putSection(f, &at, sc->tris.mem, triBytes);
+
+	return (fclose(f) == 0) && ok;
+}
+
+int scbIs(const char *fileName)
+{
+	char magic[8];
+	FILE *f = fopen(fileName, "rb");
+
+	if (f == NULL)
+		return 0;
+
+	int is = fread(magic, 1, sizeof(magic), f) == sizeof(magic) && memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+	fclose(f);
+
+	return is;
+}
+
+static int validHeader(const ScbHeader *h, size_t size)
+{
+	if (memcmp(h->magic, MAGIC, sizeof(MAGIC)) != 0 || h->version != SCB_VERSION || h->order != 0x01020304 ||
+		h->objectSize != sizeof(Object) || h->nodeSize != sizeof(BvhNode) || h->keySize != sizeof(Key) ||
+		h->faceSize != sizeof(Face))
+		return 0;
+
+	if (h->objsLen < 0 || h->nodesLen < 0 || h->primsLen < 0 || h->planesLen < 0 || h->keysLen < 0 ||
+		h->vertsLen < 0 || h->facesLen < 0 || h->triNodesLen < 0 || h->primsLen + h->planesLen > h->objsLen)
+		return 0;
+
+	// Sections in order, aligned, and inside the file
+	uint64_t ends[12] = {
+		sizeof(ScbHeader),
+		h->objs + sizeof(Object) * (uint64_t)h->objsLen,
+		h->nodes + sizeof(BvhNode) * (uint64_t)h->nodesLen,
+		h->prims + sizeof(int) * (uint64_t)h->primsLen,
+		h->planes + sizeof(int) * (uint64_t)h->planesLen,
+		h->soa + soaSize(h->primsLen, h->planesLen),
+		h->keys + sizeof(Key) * (uint64_t)h->keysLen,
+		h->verts + sizeof(Vec3) * (uint64_t)h->vertsLen,
+		h->faces + sizeof(Face) * (uint64_t)h->facesLen,
+		h->triNodes + sizeof(BvhNode) * (uint64_t)h->triNodesLen,
+		h->triPrims + sizeof(int) * (uint64_t)h->facesLen,
+		h->tris + triSoaSize(h->facesLen)
+	};
+	uint64_t starts[12] = {
+		0, h->objs, h->nodes, h->prims, h->planes, h->soa, h->keys,
+		h->verts, h->faces, h->triNodes, h->triPrims, h->tris
+	};
+
+	for (int i = 0; i < 12; i++)
+		if (starts[i] % 64 != 0 || (i > 0 && starts[i] < ends[i - 1]) || ends[i] > size)
+			return 0;
+
+	return h->end == ends[11];
+}
+
+// Children come after their parent, so one pass in index order bounds
+// both the ranges and the depth the traversal stacks reach
+static int validTree(const Bvh *bvh, int primsEnd)
+{
+	if (bvh->nodesLen == 0)
+		return 1;
+
+	int *depth = calloc(bvh->nodesLen, sizeof(int));
+	int ok = depth != NULL;
+
+	for (int i = 0; ok && i < bvh->nodesLen; i++)
+	{
+		const BvhNode *n = &bvh->nodes[i];
+
+		if (n->count > 0)
+			ok = n->first >= 0 && n->first <= bvh->primsLen - n->count;
+		else
+			ok = n->count == 0 && n->axis >= 0 && n->axis < 3 && i + 1 < bvh->nodesLen && n->first > i + 1 &&
+				 n->first < bvh->nodesLen && depth[i] + 1 < BVH_STACK;
+
+		if (ok && n->count == 0)
+		{
+			depth[i + 1] = (depth[i + 1] > depth[i] + 1) ? depth[i + 1] : depth[i] + 1;
+			depth[n->first] = (depth[n->first] > depth[i] + 1) ? depth[n->first] : depth[i] + 1;
+		}
+	}
+	free(depth);
+
+	for (int i = 0; ok && i < bvh->primsLen; i++)
+		ok = bvh->prims[i] >= 0 && bvh->prims[i] < primsEnd;
+
+	return ok;
+}
+
+// Every index the renderer follows, so a damaged file is refused rather
+// than read out of bounds. Linear in the file like the mapping itself.
+static int validIndices(const Scene *s)
+{
+	if (s->WIDTH <= 0 || s->HEIGHT <= 0 || s->WIDTH > SCENE_MAX_SIZE || s->HEIGHT > SCENE_MAX_SIZE ||
+		!(s->FOV > 0.0) || s->anim.frames < 1)
+		return 0;
+
+	for (int i = 0; i < s->objsLen; i++)
+		if (s->objs[i].type != OBJ_SPHERE && s->objs[i].type != OBJ_PLANE && s->objs[i].type != OBJ_MESH)
+			return 0;
+
+	for (int i = 0; i < s->bvh.planesLen; i++)
+		if (s->bvh.planes[i] < 0 || s->bvh.planes[i] >= s->objsLen)
+			return 0;
+
+	for (int i = 0; i < s->anim.keysLen; i++)
+	{
+		int target = s->anim.keys[i].target;
+		if (target < KEY_LIGHT || target >= s->objsLen || (target != KEY_LIGHT && s->objs[target].type == OBJ_MESH))
+			return 0;
+	}
+
+	for (int i = 0; i < s->mesh.facesLen; i++)
+	{
+		const Face *f = &s->mesh.faces[i];
+		for (int j = 0; j < 3; j++)
+			if (f->v[j] < 0 || f->v[j] >= s->mesh.vertsLen)
+				return 0;
+		if (f->obj < 0 || f->obj >= s->objsLen)
+			return 0;
+	}
+
+	return validTree(&s->bvh, s->objsLen) && validTree(&s->triBvh, s->mesh.facesLen) &&
+		   soaIdsValid(&s->soa, s->objsLen) && triSoaIdsValid(&s->tris, s->objsLen);
+}
+
+int scbLoad(const char *fileName, Scene *s)
+{
+	int fd = open(fileName, O_RDONLY);
+	struct stat st;
+
+	if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(ScbHeader))
+	{
+		if (fd >= 0)
+			close(fd);
+		return 0;
+	}
+
+	size_t size = (size_t)st.st_size;
+	char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return 0;
+
+	const ScbHeader *h = (const ScbHeader *)map;
+	if (!validHeader(h, size))
+	{
+		munmap(map, size);
+		return 0;
+	}
+
+	s->objs = (Object *)(map + h->objs);
+	s->objsLen = h->objsLen;
+	s->li = h->li;
+	s->cam = h->cam;
+	s->WIDTH = h->width;
+	s->HEIGHT = h->height;
+	s->AsR = h->asr;
+	s->FOV = h->fov;
+	s->DARKEST = h->darkest;
+
+	s->bvh = (Bvh) {
+		(BvhNode *)(map + h->nodes), h->nodesLen,
+		(int *)(map + h->prims), h->primsLen,
+		(int *)(map + h->planes), h->planesLen
+	};
+	soaBind(&s->soa, map + h->soa, h->primsLen, h->planesLen);
+
+	s->anim = (Anim) {h->frames, h->delay, (Key *)(map + h->keys), h->keysLen, 0};
+
+	s->mesh = (Mesh) {(Vec3 *)(map + h->verts), h->vertsLen, 0, (Face *)(map + h->faces), h->facesLen, 0};
+	s->triBvh = (Bvh) {
+		(BvhNode *)(map + h->triNodes), h->triNodesLen,
+		(int *)(map + h->triPrims), h->facesLen,
+		NULL, 0
+	};
+	triSoaBind(&s->tris, map + h->tris, h->facesLen);
+
+	if (!validIndices(s))
+	{
+		munmap(map, size);
+		return 0;
+	}
+	s->map = map;
+	s->mapSize = size;
+
+	return 1;
+}
@@ -0,0 +1,22 @@
+#ifndef SCB_H
+#define SCB_H
+#include "parser.h"
+
+// Compiled scenes (.scb): the objects, BVH, SoA arrays, keyframes and mesh
+// of a scene laid out exactly as in memory, each section 64 byte aligned. A
+// loaded scene points straight into the mapped file.
+enum { SCB_VERSION = 4 };
+
+// Writes sc, which must have its BVH and SoA arrays built. Returns 0 on
+// failure.
+int scbWrite(const char *fileName, const Scene *sc);
+
+// 1 when fileName starts with the .scb magic
+int scbIs(const char *fileName);
+
+// Maps fileName into s, replacing everything parseScene() would fill in.
+// Release with sceneFree(). Returns 0 when the file is missing, truncated,
+// holds an index out of range or was written by another version or ABI.
+int scbLoad(const char *fileName, Scene *s);
+
+#endif
@@ -1,5 +1,7 @@
 # Test scene
+# c x,y,z,lookX,lookY,lookZ places the camera, this is the default one
 s 800,100,1.5708,0.5
+c 0.0,0.0,0.0,0.0,0.0,-1.0
 o s,0.9,0.4,0.4,0.0,0.0,-10.0,3.0
 o s,0.9,0.4,0.9,5.0,-2.0,-10.0,2.0
 o p,0.5,0.7,0.5,0.0,-3.5,-5.0,0.0,-1.0,0.0
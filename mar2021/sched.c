@@ -0,0 +1,230 @@
+#include "sched.h"
+#include "trace.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Each worker owns a range of task ids [top, bottom) packed into one word so
+// the owner (popping from the bottom) and thieves (taking from the top) can
+// both update it with a single CAS.
+typedef struct Deque {
+	_Atomic uint64_t span;
+	char pad[64 - sizeof(uint64_t)];
+} Deque;
+
+#define SPAN(top, bot) (((uint64_t)(top) << 32) | (uint32_t)(bot))
+#define TOP(s) ((uint32_t)((s) >> 32))
+#define BOT(s) ((uint32_t)(s))
+
+struct Sched {
+	int nThreads;
+	pthread_t *threads;
+	Deque *deques;
+
+	pthread_mutex_t lock;
+	pthread_cond_t start, done;
+	unsigned gen;
+	int busy, quit;
+
+	TaskFn fn;
+	void *ctx;
+};
+
+typedef struct Worker {
+	Sched *s;
+	int id;
+} Worker;
+
+static int popTask(Deque *d)
+{
+	uint64_t s = atomic_load(&d->span);
+
+	while (TOP(s) < BOT(s))
+	{
+		if (atomic_compare_exchange_weak(&d->span, &s, SPAN(TOP(s), BOT(s) - 1)))
+			return (int)BOT(s) - 1;
+	}
+
+	return -1;
+}
+
+// Takes the upper half of a victim's remaining range, runs the first task of
+// it straight away and leaves the rest in the thief's own (empty) deque.
+static int stealTasks(Deque *victim, Deque *own)
+{
+	uint64_t s = atomic_load(&victim->span);
+
+	while (TOP(s) < BOT(s))
+	{
+		uint32_t n = (BOT(s) - TOP(s) + 1) / 2;
+
+		if (atomic_compare_exchange_weak(&victim->span, &s, SPAN(TOP(s) + n, BOT(s))))
+		{
+			atomic_store(&own->span, SPAN(TOP(s) + 1, TOP(s) + n));
+			return (int)TOP(s);
+		}
+	}
+
+	return -1;
+}
+
+static void work(Sched *s, int id)
+{
+	Deque *own = &s->deques[id];
+	unsigned seed = (unsigned)id * 2654435761u + 1;
+
+	for (;;)
+	{
+		int task;
+
+		while ((task = popTask(own)) >= 0)
+			s->fn(s->ctx, task, id);
+
+		// Own range is drained, sweep the other workers starting at a random one
+		task = -1;
+		seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+		for (int i = 0; i < s->nThreads && task < 0; i++)
+		{
+			int v = (int)((seed + i) % s->nThreads);
+			if (v != id)
+				task = stealTasks(&s->deques[v], own);
+		}
+
+		// Tasks are never created while running, so one empty sweep means done
+		if (task < 0)
+			return;
+
+		s->fn(s->ctx, task, id);
+	}
+}
+
+static void *workerMain(void *arg)
+{
+	Worker *w = arg;
+	Sched *s = w->s;
+	unsigned seen = 0;
+
+	traceName("worker", w->id);
+
+	pthread_mutex_lock(&s->lock);
+	for (;;)
+	{
+		while (s->gen == seen && !s->quit)
+			pthread_cond_wait(&s->start, &s->lock);
+		if (s->quit)
+			break;
+		seen = s->gen;
+		pthread_mutex_unlock(&s->lock);
+
+		work(s, w->id);
+
+		pthread_mutex_lock(&s->lock);
+		if (--s->busy == 0)
+			pthread_cond_signal(&s->done);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	free(w);
+	return NULL;
+}
+
+Sched *schedNew(int nThreads)
+{
+	Sched *s = calloc(1, sizeof(Sched));
+
+	if (nThreads < 1)
+		nThreads = 1;
+	if (s == NULL)
+		return NULL;
+
+	s->threads = malloc(sizeof(pthread_t) * nThreads);
+	s->deques = aligned_alloc(64, sizeof(Deque) * nThreads);
+	if (s->threads == NULL || s->deques == NULL)
+	{
+		free(s->deques);
+		free(s->threads);
+		free(s);
+		return NULL;
+	}
+
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->start, NULL);
+	pthread_cond_init(&s->done, NULL);
+
+	for (int i = 0; i < nThreads; i++)
+		atomic_init(&s->deques[i].span, 0);
+
+	// Worker 0 is whoever calls schedRun(). The pool shrinks to the workers
+	// that did start; they only read nThreads once a run is under way.
+	s->nThreads = 1;
+	for (int i = 1; i < nThreads; i++)
+	{
+		Worker *w = malloc(sizeof(Worker));
+		if (w == NULL)
+			break;
+
+		*w = (Worker){s, i};
+		if (pthread_create(&s->threads[i], NULL, workerMain, w) != 0)
+		{
+			free(w);
+			break;
+		}
+		s->nThreads++;
+	}
+
+	return s;
+}
+
+void schedFree(Sched *s)
+{
+	pthread_mutex_lock(&s->lock);
+	s->quit = 1;
+	pthread_cond_broadcast(&s->start);
+	pthread_mutex_unlock(&s->lock);
+
+	for (int i = 1; i < s->nThreads; i++)
+		pthread_join(s->threads[i], NULL);
+
+	pthread_cond_destroy(&s->done);
+	pthread_cond_destroy(&s->start);
+	pthread_mutex_destroy(&s->lock);
+	free(s->deques);
+	free(s->threads);
+	free(s);
+}
+
+int schedThreads(Sched *s)
+{
+	return s->nThreads;
+}
+
+void schedRun(Sched *s, int nTasks, TaskFn fn, void *ctx)
+{
+	// Deal contiguous ranges so neighbouring tiles start out on the same worker
+	for (int i = 0; i < s->nThreads; i++)
+	{
+		int top = (int)((long)nTasks * i / s->nThreads);
+		int bot = (int)((long)nTasks * (i + 1) / s->nThreads);
+		atomic_store(&s->deques[i].span, SPAN(top, bot));
+	}
+
+	s->fn = fn;
+	s->ctx = ctx;
+
+	pthread_mutex_lock(&s->lock);
+	s->busy = s->nThreads - 1;
+	s->gen++;
+	pthread_cond_broadcast(&s->start);
+	pthread_mutex_unlock(&s->lock);
+
+	work(s, 0);
+
+	// Time the caller spends here is a bubble: its share is done, others' is not
+	TRACE_BEGIN(join);
+	pthread_mutex_lock(&s->lock);
+	while (s->busy > 0)
+		pthread_cond_wait(&s->done, &s->lock);
+	pthread_mutex_unlock(&s->lock);
+	TRACE_END(join, "join", "tasks", nTasks);
+}
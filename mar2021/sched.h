@@ -0,0 +1,20 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+// Called once per task; worker is in [0, nThreads) and can index per-thread state
+typedef void (*TaskFn)(void *ctx, int task, int worker);
+
+typedef struct Sched Sched;
+
+// Work-stealing thread pool, nThreads includes the calling thread. Fewer
+// threads are used when some fail to start, see schedThreads(). Returns
+// NULL when out of memory.
+Sched *schedNew(int nThreads);
+void schedFree(Sched *s);
+
+int schedThreads(Sched *s);
+
+// Runs tasks [0, nTasks) across the pool and returns when all are done
+void schedRun(Sched *s, int nTasks, TaskFn fn, void *ctx);
+
+#endif
@@ -0,0 +1,184 @@
+#include "soa.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Rounds a slot count up to whole cache lines plus one full load
+static int padded(int n)
+{
+	return ((n + SOA_LANES - 1) / SOA_LANES + 1) * SOA_LANES;
+}
+
+size_t soaSize(int spheres, int planes)
+{
+	int ns = padded(spheres), np = padded(planes);
+	size_t bytes = sizeof(real) * (4 * ns + 6 * np) + sizeof(int) * (ns + np);
+
+	return (bytes + 63) / 64 * 64;
+}
+
+void soaBind(SceneSoA *soa, void *mem, int spheres, int planes)
+{
+	int ns = padded(spheres), np = padded(planes);
+	real *d = mem;
+
+	memset(soa, 0, sizeof(SceneSoA));
+	soa->mem = mem;
+	soa->cx = d; d += ns;
+	soa->cy = d; d += ns;
+	soa->cz = d; d += ns;
+	soa->r2 = d; d += ns;
+	soa->px = d; d += np;
+	soa->py = d; d += np;
+	soa->pz = d; d += np;
+	soa->nx = d; d += np;
+	soa->ny = d; d += np;
+	soa->nz = d; d += np;
+	soa->sphereId = (int *)d;
+	soa->planeId = soa->sphereId + ns;
+	soa->spheresLen = spheres;
+	soa->planesLen = planes;
+}
+
+int soaBuild(SceneSoA *soa, Object *objs, Bvh *bvh)
+{
+	int ns = padded(bvh->primsLen), np = padded(bvh->planesLen);
+	void *mem = aligned_alloc(64, soaSize(bvh->primsLen, bvh->planesLen));
+
+	memset(soa, 0, sizeof(SceneSoA));
+	if (!mem)
+		return 0;
+	// Zero the tail padding too, the block gets written out by scbWrite()
+	memset(mem, 0, soaSize(bvh->primsLen, bvh->planesLen));
+	soaBind(soa, mem, bvh->primsLen, bvh->planesLen);
+
+	for (int i = 0; i < 4 * ns + 6 * np; i++)
+		((real *)soa->mem)[i] = NAN;
+	for (int i = 0; i < ns + np; i++)
+		soa->sphereId[i] = -1;
+
+	for (int k = 0; k < bvh->primsLen; k++)
+	{
+		int i = bvh->prims[k];
+		Sphere *s = &objs[i].obj.sp;
+		soa->cx[k] = s->o.x;
+		soa->cy[k] = s->o.y;
+		soa->cz[k] = s->o.z;
+		soa->r2[k] = pow(s->r, 2.0);
+		soa->sphereId[k] = i;
+	}
+
+	for (int k = 0; k < bvh->planesLen; k++)
+	{
+		int i = bvh->planes[k];
+		Plane *p = &objs[i].obj.pl;
+		soa->px[k] = p->o.x;
+		soa->py[k] = p->o.y;
+		soa->pz[k] = p->o.z;
+		soa->nx[k] = p->n.x;
+		soa->ny[k] = p->n.y;
+		soa->nz[k] = p->n.z;
+		soa->planeId[k] = i;
+	}
+
+	return 1;
+}
+
+int soaIdsValid(const SceneSoA *soa, int objsLen)
+{
+	int ns = padded(soa->spheresLen), np = padded(soa->planesLen);
+
+	for (int i = 0; i < ns + np; i++)
+		if (soa->sphereId[i] < -1 || soa->sphereId[i] >= objsLen)
+			return 0;
+
+	return 1;
+}
+
+void soaFree(SceneSoA *soa)
+{
+	free(soa->mem);
+	memset(soa, 0, sizeof(SceneSoA));
+}
+
+size_t triSoaSize(int tris)
+{
+	int nt = padded(tris);
+	size_t bytes = sizeof(real) * 9 * nt + sizeof(int) * nt;
+
+	return (bytes + 63) / 64 * 64;
+}
+
+void triSoaBind(TriSoA *tri, void *mem, int tris)
+{
+	int nt = padded(tris);
+	real *d = mem;
+
+	memset(tri, 0, sizeof(TriSoA));
+	tri->mem = mem;
+	tri->vx = d; d += nt;
+	tri->vy = d; d += nt;
+	tri->vz = d; d += nt;
+	tri->ax = d; d += nt;
+	tri->ay = d; d += nt;
+	tri->az = d; d += nt;
+	tri->bx = d; d += nt;
+	tri->by = d; d += nt;
+	tri->bz = d; d += nt;
+	tri->triId = (int *)d;
+	tri->trisLen = tris;
+}
+
+int triSoaBuild(TriSoA *tri, const Mesh *mesh, Bvh *bvh, int idBase)
+{
+	int nt = padded(bvh->primsLen);
+	void *mem = aligned_alloc(64, triSoaSize(bvh->primsLen));
+
+	memset(tri, 0, sizeof(TriSoA));
+	if (!mem)
+		return 0;
+	memset(mem, 0, triSoaSize(bvh->primsLen));
+	triSoaBind(tri, mem, bvh->primsLen);
+
+	for (int i = 0; i < 9 * nt; i++)
+		((real *)mem)[i] = NAN;
+	for (int i = 0; i < nt; i++)
+		tri->triId[i] = -1;
+
+	for (int k = 0; k < bvh->primsLen; k++)
+	{
+		const Face *f = &mesh->faces[bvh->prims[k]];
+		Vec3 *v0 = &mesh->verts[f->v[0]];
+		Vec3 e1 = sub(&mesh->verts[f->v[1]], v0);
+		Vec3 e2 = sub(&mesh->verts[f->v[2]], v0);
+
+		tri->vx[k] = v0->x;
+		tri->vy[k] = v0->y;
+		tri->vz[k] = v0->z;
+		tri->ax[k] = e1.x;
+		tri->ay[k] = e1.y;
+		tri->az[k] = e1.z;
+		tri->bx[k] = e2.x;
+		tri->by[k] = e2.y;
+		tri->bz[k] = e2.z;
+		tri->triId[k] = idBase + bvh->prims[k];
+	}
+
+	return 1;
+}
+
+int triSoaIdsValid(const TriSoA *tri, int idBase)
+{
+	int nt = padded(tri->trisLen);
+
+	for (int i = 0; i < nt; i++)
+		if (tri->triId[i] != -1 && (tri->triId[i] < idBase || tri->triId[i] - idBase >= tri->trisLen))
+			return 0;
+
+	return 1;
+}
+
+void triSoaFree(TriSoA *tri)
+{
+	free(tri->mem);
+	memset(tri, 0, sizeof(TriSoA));
+}
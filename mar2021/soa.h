@@ -0,0 +1,61 @@
+#ifndef SOA_H
+#define SOA_H
+#include <stddef.h>
+#include "obj.h"
+#include "bvh.h"
+
+// Widest kernel lane count (one 64 byte load), arrays are padded so any slot
+// can start a full load
+enum { SOA_LANES = 64 / (int)sizeof(real) };
+
+// Structure-of-arrays copy of the scene for the intersection kernels.
+// Sphere slots follow bvh->prims so a leaf is one contiguous run, planes
+// follow bvh->planes. Padding slots hold NaN and never report a hit.
+typedef struct SceneSoA {
+	real *cx, *cy, *cz, *r2;
+	int *sphereId;
+	int spheresLen;
+
+	real *px, *py, *pz;
+	real *nx, *ny, *nz;
+	int *planeId;
+	int planesLen;
+
+	void *mem;
+} SceneSoA;
+
+// Triangles for the Möller-Trumbore kernels in leaf order of the triangle
+// tree: first vertex and the two edges leaving it. triId holds the hit id
+// reported for the face, the scene's object count plus the face index.
+typedef struct TriSoA {
+	real *vx, *vy, *vz;
+	real *ax, *ay, *az;
+	real *bx, *by, *bz;
+	int *triId;
+	int trisLen;
+
+	void *mem;
+} TriSoA;
+
+int soaBuild(SceneSoA *soa, Object *objs, Bvh *bvh);
+
+// Bytes of the single block holding all arrays, a multiple of 64
+size_t soaSize(int spheres, int planes);
+
+// Points the arrays into mem (soaSize() bytes, 64 aligned) without
+// touching its contents
+void soaBind(SceneSoA *soa, void *mem, int spheres, int planes);
+
+// 1 when every slot, padding included, holds -1 or an object index
+int soaIdsValid(const SceneSoA *soa, int objsLen);
+void soaFree(SceneSoA *soa);
+
+int triSoaBuild(TriSoA *tri, const Mesh *mesh, Bvh *bvh, int idBase);
+size_t triSoaSize(int tris);
+void triSoaBind(TriSoA *tri, void *mem, int tris);
+
+// 1 when every slot holds -1 or idBase plus a face index
+int triSoaIdsValid(const TriSoA *tri, int idBase);
+void triSoaFree(TriSoA *tri);
+
+#endif
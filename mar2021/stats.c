@@ -0,0 +1,122 @@
+#include "stats.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static const char *counterNames[STAT_COUNTERS] = {"rays", "nodes", "tests", "hits", "shadow_rays", "occluded"};
+static const char *phaseNames[STAT_PHASES] = {"parse", "build", "raygen", "traverse", "shade", "shadow", "quantize",
+											  "lzw", "io"};
+
+_Thread_local StatsBlock *statsSelf;
+
+// Blocks are never freed, pool and encoder threads live as long as the run
+static StatsBlock *blocks;
+static pthread_mutex_t blocksLock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t startTsc;
+static double startSecs;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+__attribute__((constructor))
+static void statsStart(void)
+{
+	startSecs = now();
+	startTsc = __rdtsc();
+}
+
+StatsBlock *statsRegister(void)
+{
+	StatsBlock *b = calloc(1, sizeof(StatsBlock));
+	if (b == NULL)
+	{
+		fprintf(stderr, "Out of memory for stats. Quitting...\n");
+		exit(1);
+	}
+
+	pthread_mutex_lock(&blocksLock);
+	b->next = blocks;
+	blocks = b;
+	pthread_mutex_unlock(&blocksLock);
+
+	statsSelf = b;
+	return b;
+}
+
+void statsCollect(Stats *out)
+{
+	*out = (Stats) {{0}, {0}};
+
+	pthread_mutex_lock(&blocksLock);
+	for (StatsBlock *b = blocks; b != NULL; b = b->next)
+	{
+		for (int i = 0; i < STAT_COUNTERS; i++)
+			out->count[i] += atomic_load_explicit(&b->count[i], memory_order_relaxed);
+		for (int i = 0; i < STAT_PHASES; i++)
+			out->cycles[i] += atomic_load_explicit(&b->cycles[i], memory_order_relaxed);
+	}
+	pthread_mutex_unlock(&blocksLock);
+}
+
+double statsTscHz(void)
+{
+	double secs = now() - startSecs;
+	return (secs > 0.0) ? (double)(__rdtsc() - startTsc) / secs : 1.0;
+}
+
+void statsPrint(const Stats *total, int frames)
+{
+	double ms = 1e3 / statsTscHz();
+	uint64_t sum = 0;
+
+	for (int i = 0; i < STAT_PHASES; i++)
+		sum += total->cycles[i];
+
+	fprintf(stderr, "Stats over %d frame(s), phase times summed over threads:\n", frames);
+	for (int i = 0; i < STAT_PHASES; i++)
+		fprintf(stderr, "  %-9s %14llu cycles %10.2f ms %5.1f%%\n", phaseNames[i],
+				(unsigned long long)total->cycles[i], (double)total->cycles[i] * ms,
+				(sum > 0) ? 100.0 * (double)total->cycles[i] / (double)sum : 0.0);
+
+	double rays = (total->count[STAT_RAYS] > 0) ? (double)total->count[STAT_RAYS] : 1.0;
+	for (int i = 0; i < STAT_COUNTERS; i++)
+		fprintf(stderr, "  %-11s %14llu %8.2f per primary ray\n", counterNames[i],
+				(unsigned long long)total->count[i], (double)total->count[i] / rays);
+}
+
+static void writeStats(FILE *f, const Stats *s)
+{
+	fprintf(f, "{\"counters\": {");
+	for (int i = 0; i < STAT_COUNTERS; i++)
+		fprintf(f, "%s\"%s\": %llu", i ? ", " : "", counterNames[i], (unsigned long long)s->count[i]);
+	fprintf(f, "}, \"cycles\": {");
+	for (int i = 0; i < STAT_PHASES; i++)
+		fprintf(f, "%s\"%s\": %llu", i ? ", " : "", phaseNames[i], (unsigned long long)s->cycles[i]);
+	fprintf(f, "}}");
+}
+
+int statsWriteJson(const char *path, const Stats *total, const Stats *batches, const int *batchFrames, int n)
+{
+	FILE *f = fopen(path, "w");
+	if (f == NULL)
+		return 0;
+
+	fprintf(f, "{\n  \"tsc_hz\": %.0f,\n  \"total\": ", statsTscHz());
+	writeStats(f, total);
+	fprintf(f, ",\n  \"batches\": [");
+	for (int i = 0, first = 0; i < n; first += batchFrames[i++])
+	{
+		fprintf(f, "%s\n    {\"first_frame\": %d, \"frames\": %d, \"stats\": ", i ? "," : "", first, batchFrames[i]);
+		writeStats(f, &batches[i]);
+		fprintf(f, "}");
+	}
+	fprintf(f, "\n  ]\n}\n");
+
+	return fclose(f) == 0;
+}
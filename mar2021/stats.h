@@ -0,0 +1,86 @@
+#ifndef STATS_H
+#define STATS_H
+#include <stdint.h>
+
+// Build-time instrumentation of the hot paths ('make rays_stats' defines
+// RAYS_STATS). Every thread counts into its own block, statsCollect()
+// sums the blocks between frames. Without RAYS_STATS the macros expand to
+// nothing and the renderer is unchanged.
+
+typedef enum StatCounter {
+	STAT_RAYS,      // Primary rays generated
+	STAT_NODES,     // BVH nodes visited, once per packet for packets
+	STAT_TESTS,     // Ray-primitive intersection tests
+	STAT_HITS,      // Primary rays that hit something
+	STAT_SHADOW,    // Shadow rays cast
+	STAT_OCCLUDED,  // Shadow rays that were blocked
+	STAT_COUNTERS
+} StatCounter;
+
+// Timed in TSC cycles summed over threads. Tiles run each phase over a
+// whole packet or row of pixels, so the timers cost a few reads of the TSC
+// per packet or row rather than per pixel. Shading covers lighting up to
+// the shadow ray; shadow and quantize are the steps after it.
+typedef enum StatPhase {
+	PHASE_PARSE,
+	PHASE_BUILD,
+	PHASE_RAYGEN,
+	PHASE_TRAVERSE,
+	PHASE_SHADE,
+	PHASE_SHADOW,
+	PHASE_QUANTIZE,
+	PHASE_LZW,
+	PHASE_IO,
+	STAT_PHASES
+} StatPhase;
+
+typedef struct Stats {
+	uint64_t count[STAT_COUNTERS];
+	uint64_t cycles[STAT_PHASES];
+} Stats;
+
+#ifdef RAYS_STATS
+#include <stdatomic.h>
+#include <x86intrin.h>
+
+typedef struct StatsBlock {
+	// Only the owning thread writes, relaxed atomics so others may read
+	_Atomic uint64_t count[STAT_COUNTERS];
+	_Atomic uint64_t cycles[STAT_PHASES];
+	struct StatsBlock *next;
+} StatsBlock;
+
+extern _Thread_local StatsBlock *statsSelf;
+
+// Allocates and links the calling thread's block
+StatsBlock *statsRegister(void);
+
+static inline void statsBump(_Atomic uint64_t *v, uint64_t n)
+{
+	atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+#define STATS_BLOCK() (statsSelf != NULL ? statsSelf : statsRegister())
+#define STATS_ADD(c, n) statsBump(&STATS_BLOCK()->count[c], (uint64_t)(n))
+#define STATS_BEGIN(name) uint64_t name = __rdtsc()
+#define STATS_END(phase, name) statsBump(&STATS_BLOCK()->cycles[phase], __rdtsc() - (name))
+#else
+#define STATS_ADD(c, n) ((void)0)
+#define STATS_BEGIN(name) ((void)0)
+#define STATS_END(phase, name) ((void)0)
+#endif
+
+// Totals of all threads since the start of the run
+void statsCollect(Stats *out);
+
+// Cycles per second of the TSC, measured over the run so far
+double statsTscHz(void);
+
+// Human readable summary of total over frames frames
+void statsPrint(const Stats *total, int frames);
+
+// Writes total and the per-batch deltas batches[0, n), each covering
+// batchFrames[i] frames. Returns 0 on failure.
+int statsWriteJson(const char *path, const Stats *total, const Stats *batches, const int *batchFrames, int n);
+
+#endif
@@ -0,0 +1,5 @@
+# Utah teapot from the Rust prototype on a floor
+s 800,600,1.5708,0.5
+o m,0.9,0.6,0.3,0.0,-1.5,1.0,1.0,../dec2020/teapot.obj
+o p,0.5,0.7,0.5,0.0,-1.5,-5.0,0.0,-1.0,0.0
+l 2.0,4.0,0.0,40.0
@@ -0,0 +1,126 @@
+#include "trace.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Events per thread, about 1.3 MB of ring each
+enum { TRACE_RING = 1 << 15 };
+
+typedef struct TraceEvent {
+	const char *name, *argName;
+	int64_t arg;
+	uint64_t start, dur;
+} TraceEvent;
+
+typedef struct TraceRing {
+	TraceEvent ev[TRACE_RING];
+	// Events ever recorded; only the owning thread stores to it
+	_Atomic uint64_t head;
+	int tid;
+	char name[32];
+	struct TraceRing *next;
+} TraceRing;
+
+int traceOn;
+
+static uint64_t startNs;
+static _Thread_local TraceRing *self;
+// Rings are pushed onto this list with a compare and swap and never freed
+static _Atomic(TraceRing *) rings;
+static atomic_int nextTid;
+
+static uint64_t clockNs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static TraceRing *traceRegister(void)
+{
+	TraceRing *r = calloc(1, sizeof(TraceRing));
+	if (r == NULL)
+		return NULL;
+
+	r->tid = atomic_fetch_add(&nextTid, 1) + 1;
+	snprintf(r->name, sizeof(r->name), "thread %d", r->tid);
+
+	r->next = atomic_load_explicit(&rings, memory_order_relaxed);
+	while (!atomic_compare_exchange_weak_explicit(&rings, &r->next, r, memory_order_release, memory_order_relaxed))
+		;
+
+	self = r;
+	return r;
+}
+
+void traceStart(void)
+{
+	startNs = clockNs();
+	traceOn = 1;
+	traceName("main", -1);
+}
+
+void traceName(const char *role, int index)
+{
+	if (!traceOn)
+		return;
+
+	TraceRing *r = (self != NULL) ? self : traceRegister();
+	if (r == NULL)
+		return;
+	if (index < 0)
+		snprintf(r->name, sizeof(r->name), "%s", role);
+	else
+		snprintf(r->name, sizeof(r->name), "%s %d", role, index);
+}
+
+uint64_t traceNow(void)
+{
+	return clockNs() - startNs;
+}
+
+void traceEvent(const char *name, uint64_t start, const char *argName, int64_t arg)
+{
+	TraceRing *r = (self != NULL) ? self : traceRegister();
+	if (r == NULL)
+		return;
+
+	uint64_t h = atomic_load_explicit(&r->head, memory_order_relaxed);
+	r->ev[h % TRACE_RING] = (TraceEvent) {name, argName, arg, start, traceNow() - start};
+	atomic_store_explicit(&r->head, h + 1, memory_order_release);
+}
+
+int traceWrite(const char *path)
+{
+	FILE *f = fopen(path, "w");
+	if (f == NULL)
+		return 0;
+
+	fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n"
+			   "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"rays\"}}");
+
+	for (TraceRing *r = atomic_load_explicit(&rings, memory_order_acquire); r != NULL; r = r->next)
+	{
+		uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+		uint64_t first = (head > TRACE_RING) ? head - TRACE_RING : 0;
+
+		fprintf(f, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+				r->tid, r->name);
+		fprintf(f, ",\n{\"name\": \"thread_sort_index\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"sort_index\": %d}}",
+				r->tid, r->tid);
+		if (first > 0)
+			fprintf(stderr, "Trace of %s lost its first %llu events\n", r->name, (unsigned long long)first);
+
+		for (uint64_t i = first; i < head; i++)
+		{
+			TraceEvent *e = &r->ev[i % TRACE_RING];
+			fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, "
+					   "\"args\": {\"%s\": %lld}}",
+					e->name, r->tid, (double)e->start * 1e-3, (double)e->dur * 1e-3, e->argName, (long long)e->arg);
+		}
+	}
+
+	fprintf(f, "\n]}\n");
+	return fclose(f) == 0;
+}
@@ -0,0 +1,35 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <stdint.h>
+
+// Timeline of the coarse work items (tiles, frames, LZW strips, writes) in
+// Chrome trace_event JSON, for chrome://tracing or ui.perfetto.dev. Off
+// unless traceStart() was called, an event then costs a branch. Each
+// thread appends to its own ring, the oldest events are dropped when one
+// fills up.
+
+// Set by traceStart(), read only afterwards
+extern int traceOn;
+
+// Turns recording on and names the calling thread "main". Call before any
+// other thread is started.
+void traceStart(void);
+
+// Names the calling thread in the trace, index < 0 leaves the number off
+void traceName(const char *role, int index);
+
+// Nanoseconds since traceStart()
+uint64_t traceNow(void);
+
+// Records name as running from start until now, with one integer argument
+void traceEvent(const char *name, uint64_t start, const char *argName, int64_t arg);
+
+// Writes every ring. The threads that recorded must be idle or gone.
+// Returns 0 on failure.
+int traceWrite(const char *path);
+
+#define TRACE_BEGIN(t) uint64_t t = traceOn ? traceNow() : 0
+#define TRACE_END(t, name, argName, arg) \
+	do { if (traceOn) traceEvent(name, t, argName, arg); } while (0)
+
+#endif
@@ -1,18 +1,65 @@
 #ifndef VEC3_H
 #define VEC3_H
-#include <math.h>
+// Type generic maths: sqrt(), fabs() and friends follow the type of real
+#include <tgmath.h>
+
+// Scalar of every position, direction and distance. double by default,
+// float when built with -DRAYS_FLOAT (make rays_f), which doubles the
+// lanes of every SIMD kernel.
+#ifdef RAYS_FLOAT
+typedef float real;
+#define REAL_MAX 3.402823466e+38f
+// Unit roundoff, and the slack of conservative tests (culling, box padding)
+#define REAL_EPS 1.1920929e-7f
+#define REAL_TOL 1e-4f
+#else
+typedef double real;
+#define REAL_MAX 1.7976931348623158e+308
+#define REAL_EPS 2.220446049250313e-16
+#define REAL_TOL 1e-9
+#endif
 
 typedef struct Vec3 {
-	double x;
-	double y;
-	double z;
+	real x;
+	real y;
+	real z;
 } Vec3;
 
-Vec3 sub(Vec3 *v1, Vec3 *v2);
-Vec3 add(Vec3 *v1, Vec3 *v2);
-double dot(Vec3 *v1, Vec3 *v2);
-Vec3 norm(Vec3 *v1);
-double mag(Vec3 *v1);
-Vec3 scale(Vec3 *v1, double s);
+// Everything is inline so the compiler sees through the pointers
+static inline Vec3 add(Vec3 *v1, Vec3 *v2)
+{
+	return (Vec3) {v1->x + v2->x, v1->y + v2->y, v1->z + v2->z};
+}
+
+static inline Vec3 sub(Vec3 *v1, Vec3 *v2)
+{
+	return (Vec3) {v1->x - v2->x, v1->y - v2->y, v1->z - v2->z};
+}
+
+static inline real dot(Vec3 *v1, Vec3 *v2)
+{
+	return v1->x * v2->x + v1->y * v2->y + v1->z * v2->z;
+}
+
+static inline real mag(Vec3 *v1)
+{
+	return sqrt(dot(v1, v1));
+}
+
+static inline Vec3 norm(Vec3 *v1)
+{
+	real m = mag(v1);
+	return (Vec3) {v1->x / m, v1->y / m, v1->z / m};
+}
+
+static inline Vec3 scale(Vec3 *v1, real s)
+{
+	return (Vec3) {v1->x * s, v1->y * s, v1->z * s};
+}
+
+static inline Vec3 cross(Vec3 *v1, Vec3 *v2)
+{
+	return (Vec3) {v1->y * v2->z - v1->z * v2->y, v1->z * v2->x - v1->x * v2->z, v1->x * v2->y - v1->y * v2->x};
+}
 
-#endif
\ No newline at end of file
+#endif
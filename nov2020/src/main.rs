@@ -1,11 +1,11 @@
 extern crate nalgebra as na;
 extern crate image as image;
+mod sampler;
 use na::{Vector3};
 use image::{DynamicImage, Rgba};
 use crate::image::GenericImage;
 use std::ops::{Add, Mul, Div};
 use std::time::{Instant};
-use rand::Rng;
 
 const WIDTH: u32 = 800;
 const HEIGHT: u32 = 600;
@@ -13,6 +13,7 @@ const ASR: f32 = WIDTH as f32 / HEIGHT as f32;
 const FOV: f32 = 90.0;
 const GAMMA: f32 = 2.2;
 const SS: u8 = 1;
+const SEED: u32 = 1;
 
 fn main() {
     let mut world_spheres: Vec<Sphere> = Vec::new();
@@ -25,14 +26,18 @@ fn main() {
     // let background = Color::new(0.1, 0.1, 0.1);
     let bg_img = image::open("src/bg.jpg").unwrap().to_rgba();
 
-    let mut rng = rand::thread_rng();
     let exec_time = Instant::now();
     for x in 0..WIDTH {
         for y in 0..HEIGHT {
             let mut out_col = Color::new(0.0, 0.0, 0.0);
-            for _ in 0..SS {
-                // let ray = new_ray(x as f32 + rng.gen_range(0.0, 1.0), y as f32 + rng.gen_range(0.0, 1.0));
-                let ray = new_ray(x as f32, y as f32);
+            for s in 0..SS {
+                // Jitter inside the pixel only when there is more than one sample
+                let ray = if SS > 1 {
+                    let (u, v) = sampler::get2(SEED, y * WIDTH + x, s as u32, sampler::DIM_PIXEL);
+                    new_ray(x as f32 + u - 0.5, y as f32 + v - 0.5)
+                } else {
+                    new_ray(x as f32, y as f32)
+                };
 
                 let (sp_i, hit_t) = trace_inersection(&ray, world_spheres.as_slice());
                 let sphere = &world_spheres[sp_i];
@@ -0,0 +1,146 @@
+// Random numbers for the renderer. Everything here is a pure function of a
+// seed and the (pixel, sample) being traced, so an image comes out the same
+// whichever thread traces which pixel and in what order. Port of
+// jan2021/sampler.c, both return the same points up to f32 rounding.
+
+// Not every dimension or the stream generator is used by this renderer yet
+#![allow(dead_code)]
+
+// Sample dimensions, in pairs. Only the two dimensions of a named pair are
+// stratified together: the first 16 points of a pixel fill a 4x4 grid of
+// each pair. Other combinations of dimensions are not. Each group of four
+// dimensions has its own scramble.
+pub const DIM_PIXEL: u32 = 0;
+pub const DIM_LENS: u32 = 2;
+pub const DIM_LIGHT: u32 = 4;
+pub const DIM_TIME: u32 = 6;
+
+// Joe-Kuo direction numbers of the first four Sobol dimensions
+const SOBOL: [[u32; 32]; 4] = [
+    [
+        0x80000000, 0x40000000, 0x20000000, 0x10000000, 0x08000000, 0x04000000, 0x02000000, 0x01000000,
+        0x00800000, 0x00400000, 0x00200000, 0x00100000, 0x00080000, 0x00040000, 0x00020000, 0x00010000,
+        0x00008000, 0x00004000, 0x00002000, 0x00001000, 0x00000800, 0x00000400, 0x00000200, 0x00000100,
+        0x00000080, 0x00000040, 0x00000020, 0x00000010, 0x00000008, 0x00000004, 0x00000002, 0x00000001,
+    ],
+    [
+        0x80000000, 0xc0000000, 0xa0000000, 0xf0000000, 0x88000000, 0xcc000000, 0xaa000000, 0xff000000,
+        0x80800000, 0xc0c00000, 0xa0a00000, 0xf0f00000, 0x88880000, 0xcccc0000, 0xaaaa0000, 0xffff0000,
+        0x80008000, 0xc000c000, 0xa000a000, 0xf000f000, 0x88008800, 0xcc00cc00, 0xaa00aa00, 0xff00ff00,
+        0x80808080, 0xc0c0c0c0, 0xa0a0a0a0, 0xf0f0f0f0, 0x88888888, 0xcccccccc, 0xaaaaaaaa, 0xffffffff,
+    ],
+    [
+        0x80000000, 0xc0000000, 0x60000000, 0x90000000, 0xe8000000, 0x5c000000, 0x8e000000, 0xc5000000,
+        0x68800000, 0x9cc00000, 0xee600000, 0x55900000, 0x80680000, 0xc09c0000, 0x60ee0000, 0x90550000,
+        0xe8808000, 0x5cc0c000, 0x8e606000, 0xc5909000, 0x6868e800, 0x9c9c5c00, 0xeeee8e00, 0x5555c500,
+        0x8000e880, 0xc0005cc0, 0x60008e60, 0x9000c590, 0xe8006868, 0x5c009c9c, 0x8e00eeee, 0xc5005555,
+    ],
+    [
+        0x80000000, 0xc0000000, 0x20000000, 0x50000000, 0xf8000000, 0x74000000, 0xa2000000, 0x93000000,
+        0xd8800000, 0x25400000, 0x59e00000, 0xe6d00000, 0x78080000, 0xb40c0000, 0x82020000, 0xc3050000,
+        0x208f8000, 0x51474000, 0xfbea2000, 0x75d93000, 0xa0858800, 0x914e5400, 0xdbe79e00, 0x25db6d00,
+        0x58800080, 0xe54000c0, 0x79e00020, 0xb6d00050, 0x800800f8, 0xc00c0074, 0x200200a2, 0x50050093,
+    ]
+];
+
+// xoshiro256** state, one per thread or per (pixel, sample) stream
+pub struct Rng {
+    s: [u64; 4]
+}
+
+impl Rng {
+    pub fn new(seed: u64) -> Self {
+        let mut x = seed;
+        Rng { s: [splitmix64(&mut x), splitmix64(&mut x), splitmix64(&mut x), splitmix64(&mut x)] }
+    }
+
+    // Independent stream for one sample of one pixel
+    pub fn stream(seed: u64, pixel: u32, sample: u32) -> Self {
+        Rng::new(seed ^ ((pixel as u64) << 32 | sample as u64).wrapping_mul(0xd1342543de82ef95))
+    }
+
+    pub fn next_u64(&mut self) -> u64 {
+        let s = &mut self.s;
+        let out = s[1].wrapping_mul(5).rotate_left(7).wrapping_mul(9);
+        let t = s[1] << 17;
+
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = s[3].rotate_left(45);
+
+        out
+    }
+
+    // Uniform in [0, 1)
+    pub fn next_f32(&mut self) -> f32 {
+        (self.next_u64() >> 40) as f32 * (1.0 / 16777216.0)
+    }
+}
+
+fn splitmix64(x: &mut u64) -> u64 {
+    *x = x.wrapping_add(0x9e3779b97f4a7c15);
+    let mut z = *x;
+    z = (z ^ (z >> 30)).wrapping_mul(0xbf58476d1ce4e5b9);
+    z = (z ^ (z >> 27)).wrapping_mul(0x94d049bb133111eb);
+    z ^ (z >> 31)
+}
+
+// 32 bit integer hash with good avalanche (lowbias32)
+fn hash32(mut x: u32) -> u32 {
+    x ^= x >> 16;
+    x = x.wrapping_mul(0x7feb352d);
+    x ^= x >> 15;
+    x = x.wrapping_mul(0x846ca68b);
+    x ^= x >> 16;
+    x
+}
+
+fn hash_combine(seed: u32, v: u32) -> u32 {
+    seed ^ v.wrapping_add(seed << 6).wrapping_add(seed >> 2)
+}
+
+// Owen scrambling as a hash (Burley 2020): every bit is flipped depending on
+// the bits above it, which keeps the Sobol strata intact
+fn owen_scramble(x: u32, seed: u32) -> u32 {
+    let mut x = x.reverse_bits();
+    x = x.wrapping_add(seed);
+    x ^= x.wrapping_mul(0x6c50b47c);
+    x ^= x.wrapping_mul(0xb82f1e52);
+    x ^= x.wrapping_mul(0xc7afe638);
+    x ^= x.wrapping_mul(0x8d22f6e6);
+    x.reverse_bits()
+}
+
+fn sobol(mut index: u32, dim: usize) -> u32 {
+    let mut x = 0;
+    let mut bit = 0;
+    while index != 0 {
+        if index & 1 != 0 {
+            x ^= SOBOL[dim][bit];
+        }
+        index >>= 1;
+        bit += 1;
+    }
+    x
+}
+
+// Point number sample of the pixel's own scrambled Sobol sequence, in
+// [0, 1). Any power of two prefix of a pixel's samples covers every
+// dimension evenly.
+pub fn get(seed: u32, pixel: u32, sample: u32, dim: u32) -> f32 {
+    // Each group of four dimensions shuffles the pixel's samples its own way
+    let key = hash32(hash_combine(hash32(seed ^ pixel.wrapping_mul(0x9e3779b9)), dim / 4));
+    let index = owen_scramble(sample, key);
+    let x = owen_scramble(sobol(index, (dim % 4) as usize), hash_combine(key, dim % 4));
+
+    // Top 24 bits only, so the result stays below 1.0 as an f32
+    (x >> 8) as f32 * (1.0 / 16777216.0)
+}
+
+// Dimensions dim and dim + 1 at once, dim even
+pub fn get2(seed: u32, pixel: u32, sample: u32, dim: u32) -> (f32, f32) {
+    (get(seed, pixel, sample, dim), get(seed, pixel, sample, dim + 1))
+}